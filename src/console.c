@@ -0,0 +1,100 @@
+/*
+ * Line based command console over stdio (USB) for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "console.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#define MAX_LINE (80)
+#define MAX_ARGS (8)
+
+struct command {
+    char const* name;
+    char const* help;
+    console_command_t func;
+    void* ctx;
+};
+
+struct console {
+    char line[MAX_LINE];
+    size_t len;
+    size_t num_commands;
+    struct command* commands;
+};
+
+static void run(struct console* c) {
+    char* argv[MAX_ARGS];
+    int argc = 0;
+    char* save;
+
+    for (char* tok = strtok_r(c->line, " \t", &save); tok && argc < MAX_ARGS;
+         tok = strtok_r(NULL, " \t", &save)) {
+        argv[argc++] = tok;
+    }
+
+    if (!argc) {
+        return;
+    }
+
+    for (size_t i = 0; i < c->num_commands; i++) {
+        if (strcmp(argv[0], c->commands[i].name) == 0) {
+            c->commands[i].func(c->commands[i].ctx, argc, argv);
+            return;
+        }
+    }
+
+    if (strcmp(argv[0], "help") != 0) {
+        printf("Unknown command '%s'\n", argv[0]);
+    }
+    for (size_t i = 0; i < c->num_commands; i++) {
+        printf("%s - %s\n", c->commands[i].name, c->commands[i].help);
+    }
+}
+
+struct console* console_create(void) {
+    struct console* c = calloc(1, sizeof(*c));
+    return c;
+}
+
+void console_free(struct console* c) {
+    free(c->commands);
+    free(c);
+}
+
+void console_add_command(struct console* c, char const* name,
+                         char const* help, console_command_t func, void* ctx) {
+    c->commands =
+        realloc(c->commands, sizeof(*c->commands) * (c->num_commands + 1));
+    c->commands[c->num_commands].name = name;
+    c->commands[c->num_commands].help = help;
+    c->commands[c->num_commands].func = func;
+    c->commands[c->num_commands].ctx = ctx;
+    c->num_commands++;
+}
+
+/*
+ * Reads whatever input is available without waiting, and runs the command
+ * once a full line has been received
+ */
+void console_update(struct console* c) {
+    int ch;
+
+    while ((ch = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+        if (ch == '\r' || ch == '\n') {
+            c->line[c->len] = '\0';
+            c->len = 0;
+            run(c);
+        } else if (c->len < sizeof(c->line) - 1) {
+            c->line[c->len++] = ch;
+        }
+    }
+}
@@ -0,0 +1,21 @@
+/*
+ * Line based command console over stdio (USB) for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _CONSOLE_H_
+#define _CONSOLE_H_
+
+typedef void (*console_command_t)(void* ctx, int argc, char** argv);
+
+struct console;
+
+struct console* console_create(void);
+void console_free(struct console* c);
+void console_add_command(struct console* c, char const* name,
+                         char const* help, console_command_t func, void* ctx);
+void console_update(struct console* c);
+
+#endif
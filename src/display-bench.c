@@ -0,0 +1,167 @@
+/*
+ * Throughput benchmark for the Newhaven Display K3Z driver
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "display-bench.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hardware/dma.h"
+#include "nhd-k3z.h"
+#include "pico/stdlib.h"
+
+/*
+ * The display UART TX is looped back (with a jumper) into the RX pin of the
+ * same UART, and the received bytes are captured with DMA. For each workload
+ * this measures the time the CPU spends in the driver, the time until the
+ * last byte has arrived, and the resulting throughput
+ */
+#define RX_BUFFER_SIZE (256)
+
+#define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
+
+/*
+ * Once the UART is idle, the capture is done when nothing more has arrived
+ * for this long (a few character times at the slowest useful baud rate)
+ */
+#define RX_IDLE_US (2000)
+
+struct bench {
+    struct nhdk3z* d;
+    uart_inst_t* uart;
+    int dma_chan;
+    uint8_t rx[RX_BUFFER_SIZE];
+};
+
+/* The workloads mirror what the main loop draws */
+static void full_redraw(struct nhdk3z* d, unsigned int n) {
+    nhdk3z_clear(d);
+    nhdk3z_home(d);
+    nhdk3z_printf(d, "Running %u:%02u:%02u", 0, n / 60 % 60, n % 60);
+    nhdk3z_set_cursor(d, 0x40);
+    nhdk3z_printf(d, "RPM %d (%d%%)", 60, n % 100);
+}
+
+static void seconds_update(struct nhdk3z* d, unsigned int n) {
+    nhdk3z_set_cursor(d, 0x0E);
+    nhdk3z_printf(d, "%02u", n % 60);
+}
+
+static void ramp_percent_update(struct nhdk3z* d, unsigned int n) {
+    nhdk3z_set_cursor(d, 0x47);
+    nhdk3z_printf(d, "(%d%%)", n % 100);
+}
+
+static const struct {
+    char const* name;
+    void (*func)(struct nhdk3z* d, unsigned int n);
+} workloads[] = {
+    {"full_redraw", full_redraw},
+    {"seconds", seconds_update},
+    {"ramp_percent", ramp_percent_update},
+};
+
+static size_t rx_count(struct bench const* b) {
+    return RX_BUFFER_SIZE - dma_channel_hw_addr(b->dma_chan)->transfer_count;
+}
+
+static void start_capture(struct bench* b) {
+    while (uart_is_readable(b->uart)) {
+        uart_getc(b->uart);
+    }
+    dma_channel_set_write_addr(b->dma_chan, b->rx, false);
+    dma_channel_set_trans_count(b->dma_chan, RX_BUFFER_SIZE, true);
+}
+
+/*
+ * Feeds the driver's queue out until it is empty. Returns the time the last
+ * byte arrived. The time spent in updates that moved bytes is added to cpu_us;
+ * updates that found the UART FIFO full would have cost the main loop next
+ * to nothing, so counting them would only measure the transfer time again
+ */
+static uint64_t wait_capture(struct bench* b, uint64_t* cpu_us) {
+    size_t count = rx_count(b);
+    uint64_t last = time_us_64();
+
+    while (nhdk3z_busy(b->d) || time_us_64() - last < RX_IDLE_US) {
+        size_t queued = nhdk3z_queued(b->d);
+        uint64_t start = time_us_64();
+        nhdk3z_update(b->d);
+        if (nhdk3z_queued(b->d) != queued) {
+            *cpu_us += time_us_64() - start;
+        }
+
+        if (rx_count(b) != count) {
+            count = rx_count(b);
+            last = time_us_64();
+        }
+    }
+    dma_channel_abort(b->dma_chan);
+    return last;
+}
+
+void display_bench_run(struct nhdk3z* d, uart_inst_t* uart,
+                       unsigned int rx_pin, unsigned int iterations) {
+    struct bench b = {
+        .d = d,
+        .uart = uart,
+        .dma_chan = dma_claim_unused_channel(true),
+    };
+
+    dma_channel_config c = dma_channel_get_default_config(b.dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, uart_get_dreq(uart, false));
+    dma_channel_configure(b.dma_chan, &c, b.rx, &uart_get_hw(uart)->dr, 0,
+                          false);
+
+    gpio_set_function(rx_pin, GPIO_FUNC_UART);
+
+    /* Let anything already queued finish before measuring */
+    uint64_t cpu_us = 0;
+    start_capture(&b);
+    wait_capture(&b, &cpu_us);
+
+    printf("workload,iterations,bytes,cpu_us,latency_us,bytes_per_sec\n");
+    for (size_t w = 0; w < ARRAY_COUNT(workloads); w++) {
+        uint64_t bytes = 0;
+        uint64_t latency_us = 0;
+
+        cpu_us = 0;
+
+        for (unsigned int n = 0; n < iterations; n++) {
+            start_capture(&b);
+
+            uint64_t start = time_us_64();
+            workloads[w].func(d, n);
+            uint64_t end = time_us_64();
+
+            uint64_t last = wait_capture(&b, &cpu_us);
+
+            bytes += rx_count(&b);
+            cpu_us += end - start;
+            latency_us += MAX(last, end) - start;
+        }
+
+        if (!bytes) {
+            printf("No bytes received; is TX looped back to GPIO %u?\n",
+                   rx_pin);
+            break;
+        }
+
+        printf("%s,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               workloads[w].name, iterations, bytes / iterations,
+               cpu_us / iterations, latency_us / iterations,
+               latency_us ? bytes * 1000000 / latency_us : 0);
+    }
+
+    gpio_deinit(rx_pin);
+    dma_channel_unclaim(b.dma_chan);
+}
@@ -0,0 +1,17 @@
+/*
+ * Throughput benchmark for the Newhaven Display K3Z driver
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _DISPLAY_BENCH_H_
+#define _DISPLAY_BENCH_H_
+
+#include "nhd-k3z.h"
+#include "pico/stdlib.h"
+
+void display_bench_run(struct nhdk3z* d, uart_inst_t* uart,
+                       unsigned int rx_pin, unsigned int iterations);
+
+#endif
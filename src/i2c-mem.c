@@ -0,0 +1,253 @@
+/*
+ * Pico Pi driver for I2C FRAM and EEPROM memories
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "i2c-mem.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware/dma.h"
+#include "hardware/i2c.h"
+#include "pico/stdlib.h"
+
+/*
+ * How long to keep retrying a device that doesn't acknowledge. An EEPROM
+ * ignores its address for up to 5 ms while programming a page
+ */
+#define WRITE_TIMEOUT_US (20000)
+
+enum state {
+    STATE_IDLE,
+    STATE_WRITING,
+};
+
+struct i2cmem {
+    i2c_inst_t* i2c;
+    uint8_t addr;
+    size_t page_size;
+    int dma_chan;
+    enum state state;
+
+    /* Write in progress */
+    uint8_t data[I2CMEM_MAX_WRITE];
+    uint32_t offset;
+    size_t len;
+    size_t done;
+    size_t chunk;
+    uint32_t chunk_start;
+
+    /* Write queued behind the one in progress */
+    bool pending;
+    uint8_t pending_data[I2CMEM_MAX_WRITE];
+    uint32_t pending_offset;
+    size_t pending_len;
+
+    /* Memory address followed by the data, in I2C data command format */
+    uint32_t cmd[I2CMEM_MAX_WRITE + 2];
+};
+
+/*
+ * Queues the next chunk (up to the end of the page for EEPROM) to the I2C
+ * controller with DMA. The last byte carries the STOP, so the controller
+ * holds the bus if the DMA falls behind
+ */
+static void start_chunk(struct i2cmem* m) {
+    i2c_hw_t* hw = i2c_get_hw(m->i2c);
+    uint32_t offset = m->offset + m->done;
+    size_t n = m->len - m->done;
+
+    if (m->page_size) {
+        n = MIN(n, m->page_size - offset % m->page_size);
+    }
+
+    m->cmd[0] = (offset >> 8) & 0xFF;
+    m->cmd[1] = offset & 0xFF;
+    for (size_t i = 0; i < n; i++) {
+        m->cmd[i + 2] = m->data[m->done + i];
+    }
+    m->cmd[n + 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+    m->chunk = n;
+
+    hw->enable = 0;
+    hw->tar = m->addr;
+    hw->enable = 1;
+    (void)hw->clr_stop_det;
+    (void)hw->clr_tx_abrt;
+
+    dma_channel_transfer_from_buffer_now(m->dma_chan, m->cmd, n + 2);
+}
+
+static void start_write(struct i2cmem* m, uint32_t offset, void const* data,
+                        size_t len) {
+    memcpy(m->data, data, len);
+    m->offset = offset;
+    m->len = len;
+    m->done = 0;
+    m->chunk_start = time_us_32();
+    m->state = STATE_WRITING;
+    start_chunk(m);
+}
+
+struct i2cmem* i2cmem_create(i2c_inst_t* i2c, unsigned int baudrate,
+                             uint8_t addr, size_t page_size) {
+    struct i2cmem* m = calloc(1, sizeof(*m));
+
+    m->i2c = i2c;
+    m->addr = addr;
+    m->page_size = page_size;
+    i2c_init(i2c, baudrate);
+
+    m->dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(m->dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, i2c_get_dreq(i2c, true));
+    dma_channel_configure(m->dma_chan, &c, &i2c_get_hw(i2c)->data_cmd, NULL,
+                          0, false);
+
+    return m;
+}
+
+void i2cmem_free(struct i2cmem* m) {
+    dma_channel_abort(m->dma_chan);
+    dma_channel_unclaim(m->dma_chan);
+    i2c_deinit(m->i2c);
+    free(m);
+}
+
+bool i2cmem_read(struct i2cmem* m, uint32_t offset, void* buffer,
+                 size_t len) {
+    const uint8_t addr[] = {(offset >> 8) & 0xFF, offset & 0xFF};
+    uint32_t start = time_us_32();
+
+    while (i2cmem_update(m) != I2CMEM_IDLE) {
+    }
+
+    do {
+        if (i2c_write_blocking(m->i2c, m->addr, addr, sizeof(addr), true) ==
+            sizeof(addr)) {
+            return i2c_read_blocking(m->i2c, m->addr, buffer, len, false) ==
+                   (int)len;
+        }
+    } while (m->page_size && time_us_32() - start < WRITE_TIMEOUT_US);
+
+    return false;
+}
+
+/*
+ * Returns false if the write can't be queued: it is too long, or a write to
+ * a different offset is already queued behind the one in progress
+ */
+bool i2cmem_write(struct i2cmem* m, uint32_t offset, void const* data,
+                  size_t len) {
+    if (!len || len > I2CMEM_MAX_WRITE) {
+        return false;
+    }
+
+    if (m->state == STATE_IDLE) {
+        start_write(m, offset, data, len);
+        return true;
+    }
+
+    /*
+     * Only the newest data for a location matters, so a queued write to the
+     * same offset is replaced
+     */
+    if (m->pending && m->pending_offset != offset) {
+        return false;
+    }
+
+    memcpy(m->pending_data, data, len);
+    m->pending_offset = offset;
+    m->pending_len = len;
+    m->pending = true;
+    return true;
+}
+
+enum i2cmem_status i2cmem_update(struct i2cmem* m) {
+    i2c_hw_t* hw = i2c_get_hw(m->i2c);
+
+    if (m->state == STATE_WRITING) {
+        bool failed = false;
+        uint32_t status = hw->raw_intr_stat;
+        if (!(status & (I2C_IC_RAW_INTR_STAT_STOP_DET_BITS |
+                        I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS))) {
+            return I2CMEM_BUSY;
+        }
+
+        if (status & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+            /*
+             * Not acknowledged. Either an EEPROM still programming the
+             * previous page, or no device at all
+             */
+            dma_channel_abort(m->dma_chan);
+            if (!(status & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS)) {
+                return I2CMEM_BUSY;
+            }
+
+            if (time_us_32() - m->chunk_start < WRITE_TIMEOUT_US) {
+                start_chunk(m);
+                return I2CMEM_BUSY;
+            }
+            failed = true;
+        } else {
+            m->done += m->chunk;
+            m->chunk_start = time_us_32();
+        }
+
+        if (!failed && m->done < m->len) {
+            start_chunk(m);
+            return I2CMEM_BUSY;
+        }
+
+        (void)hw->clr_stop_det;
+        (void)hw->clr_tx_abrt;
+        m->state = STATE_IDLE;
+        if (failed) {
+            return I2CMEM_FAILED;
+        }
+    }
+
+    if (m->pending) {
+        m->pending = false;
+        start_write(m, m->pending_offset, m->pending_data, m->pending_len);
+        return I2CMEM_BUSY;
+    }
+
+    return I2CMEM_IDLE;
+}
+
+static bool storage_read(void* ctx, uint32_t offset, void* buffer,
+                         size_t len) {
+    return i2cmem_read(ctx, offset, buffer, len);
+}
+
+static bool storage_write(void* ctx, uint32_t offset, void const* data,
+                          size_t len) {
+    return i2cmem_write(ctx, offset, data, len);
+}
+
+static enum persist_status storage_update(void* ctx) {
+    switch (i2cmem_update(ctx)) {
+        case I2CMEM_BUSY:
+            return PERSIST_WRITING;
+        case I2CMEM_FAILED:
+            return PERSIST_FAILED;
+        default:
+            return PERSIST_IDLE;
+    }
+}
+
+void i2cmem_get_storage(struct i2cmem* m, struct persist_storage* storage) {
+    storage->read = storage_read;
+    storage->write = storage_write;
+    storage->update = storage_update;
+    storage->ctx = m;
+}
@@ -0,0 +1,47 @@
+/*
+ * Pico Pi driver for I2C FRAM and EEPROM memories
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _I2C_MEM_H_
+#define _I2C_MEM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/i2c.h"
+#include "persist.h"
+
+/* Largest single write */
+#define I2CMEM_MAX_WRITE (64)
+
+struct i2cmem;
+
+enum i2cmem_status {
+    I2CMEM_IDLE,
+    I2CMEM_BUSY,
+    /*
+     * A write was abandoned because the device didn't acknowledge it in
+     * time. Returned once; any queued write is started on the next update
+     */
+    I2CMEM_FAILED,
+};
+
+/*
+ * page_size is 0 for FRAM, which has no pages and no write cycle time. For
+ * EEPROM it is the device's write page size; writes are split at page
+ * boundaries and the device is polled until each page is programmed
+ */
+struct i2cmem* i2cmem_create(i2c_inst_t* i2c, unsigned int baudrate,
+                             uint8_t addr, size_t page_size);
+void i2cmem_free(struct i2cmem* m);
+bool i2cmem_read(struct i2cmem* m, uint32_t offset, void* buffer, size_t len);
+bool i2cmem_write(struct i2cmem* m, uint32_t offset, void const* data,
+                  size_t len);
+enum i2cmem_status i2cmem_update(struct i2cmem* m);
+void i2cmem_get_storage(struct i2cmem* m, struct persist_storage* storage);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Latency histograms
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "latency.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+struct latency {
+    char const* name;
+    bool pending;
+    uint32_t start;
+
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[LATENCY_BUCKETS];
+};
+
+struct latency* latency_create(char const* name) {
+    struct latency* l = calloc(1, sizeof(*l));
+    l->name = name;
+    return l;
+}
+
+void latency_free(struct latency* l) { free(l); }
+
+/*
+ * Starts a measurement. Times are from time_us_32(), so an interval must be
+ * less than about 71 minutes
+ */
+void latency_start(struct latency* l, uint32_t start_us) {
+    l->pending = true;
+    l->start = start_us;
+}
+
+void latency_cancel(struct latency* l) { l->pending = false; }
+
+bool latency_pending(struct latency const* l) { return l->pending; }
+
+void latency_stop(struct latency* l, uint32_t now_us) {
+    if (!l->pending) {
+        return;
+    }
+
+    uint32_t us = now_us - l->start;
+    size_t bucket = 0;
+    while ((us >> bucket) > 1 && bucket < LATENCY_BUCKETS - 1) {
+        bucket++;
+    }
+
+    l->min = l->count ? MIN(l->min, us) : us;
+    l->max = MAX(l->max, us);
+    l->sum += us;
+    l->count++;
+    l->buckets[bucket]++;
+    l->pending = false;
+}
+
+void latency_reset(struct latency* l) {
+    char const* name = l->name;
+    memset(l, 0, sizeof(*l));
+    l->name = name;
+}
+
+void latency_print(struct latency const* l) {
+    printf("%s: count %" PRIu32, l->name, l->count);
+    if (!l->count) {
+        printf("\n");
+        return;
+    }
+    printf(" min %" PRIu32 " mean %" PRIu64 " max %" PRIu32 " us\n", l->min,
+           l->sum / l->count, l->max);
+
+    for (size_t n = 0; n < LATENCY_BUCKETS; n++) {
+        if (l->buckets[n]) {
+            printf("  >= %" PRIu32 " us: %" PRIu32 "\n",
+                   (uint32_t)(n ? 1u << n : 0), l->buckets[n]);
+        }
+    }
+}
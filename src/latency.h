@@ -0,0 +1,28 @@
+/*
+ * Latency histograms
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Power of 2 microsecond buckets, so the last is 2^23 us (~8 s) and up */
+#define LATENCY_BUCKETS (24)
+
+struct latency;
+
+struct latency* latency_create(char const* name);
+void latency_free(struct latency* l);
+void latency_start(struct latency* l, uint32_t start_us);
+void latency_cancel(struct latency* l);
+bool latency_pending(struct latency const* l);
+void latency_stop(struct latency* l, uint32_t now_us);
+void latency_reset(struct latency* l);
+void latency_print(struct latency const* l);
+
+#endif
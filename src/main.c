@@ -5,18 +5,38 @@
  */
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "button.h"
+#include "console.h"
+#include "display-bench.h"
+#include "hardware/adc.h"
 #include "hardware/pwm.h"
+#include "i2c-mem.h"
+#include "latency.h"
 #include "nhd-k3z.h"
 #include "persist.h"
 #include "pico/stdlib.h"
+#include "profiler.h"
+#include "pt.h"
+#include "rollup.h"
+#include "scope.h"
+#include "speed-bench.h"
 #include "stepper-motor.h"
+#include "timebase.h"
 
 #define VERSION "1.0"
 
+#ifdef HIGH_SPEED
+#define MAX_RPM (300)
+#else
 #define MAX_RPM (60)
+#endif
 #define RPM_STEP (5)
+/* Above this, the up and down buttons change the speed in larger steps */
+#define HIGH_SPEED_RPM (60)
+#define RPM_STEP_HIGH (20)
 #define STEPS_PER_REV (200)
 #define SLEEP_TIMEOUT_US (60 * 1000000)
 
@@ -41,8 +61,67 @@
 
 #define MOTOR_ACCEL (60)
 
+/*
+ * Phase changes ramp the coil drive over this many PWM periods (about 530 us
+ * at 15 kHz) to avoid current spikes and clicks at low speed. At high speed
+ * the driver shortens the ramp to fit in half the step period
+ */
+#define MOTOR_RAMP_PERIODS (8)
+
+/*
+ * Half steps are smooth at nutating speeds, but half of them only use one coil.
+ * Faster, the motor takes full steps on two coils for torque, and acceleration
+ * is reduced as torque falls off. A burst of catch up steps after a stall would
+ * lose sync at these speeds, so missed steps are dropped. The drive stays at
+ * MOTOR_DUTY_CYCLE, the thermal limit found by hand, until a higher one has
+ * been checked with speedbench and a thermal test on the motor and driver
+ */
+static const struct stepper_speed_band motor_speed_bands[] = {
+    {.min_rpm = 0, .full_step = false},
+    {.min_rpm = 90, .full_step = true, .drop_missed = true},
+    {.min_rpm = 180,
+     .full_step = true,
+     .accel_rpm_per_sec = 30,
+     .drop_missed = true},
+};
+
+/*
+ * When running, steps later than this percentage of the step interval for
+ * LATE_LIMIT_US mean the firmware can't keep up with the speed, and the speed
+ * is limited. A short stall (like a flash write) is caught up well within
+ * that time
+ */
+#define LATE_LIMIT_PERCENT (25)
+#define LATE_LIMIT_US (250000)
+
+/* Time spent measuring at each speed by the speed benchmark */
+#define SPEED_BENCH_HOLD_US (5000000)
+
+/*
+ * Granularity of the ramp percentage shown on the display. Each change is a
+ * redraw, so this is kept coarse enough to not flood the display UART
+ */
+#define RAMP_PERCENT_STEP (5)
+
 #define LED_PIN (25)
 
+/*
+ * Slowly changing telemetry is sampled at this interval; step lateness and
+ * loop time are sampled on every step and loop
+ */
+#define TELEMETRY_SAMPLE_US (100000)
+
+#define TEMPERATURE_ADC_INPUT (4)
+
+/*
+ * A new timer trim measured against USB is applied straight away, but only
+ * saved once the motor has come to a stop (which can take seconds after it is
+ * switched off) and not while calibrating, and only if it differs from the
+ * saved one by more than this. The crystal drifts by a few ppm with
+ * temperature, and each save is a flash write that stalls everything
+ */
+#define CLOCK_TRIM_SAVE_PPB (5000)
+
 #define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
 
 /*
@@ -64,25 +143,111 @@ static const unsigned int motor_pins[] = {0, 4, 2, 6};
 #define DISPLAY_PIN (12)
 #define DISPLAY_UART (uart0)
 
+/*
+ * For benchmarking the display driver, the display TX is looped back to this
+ * pin (the display UART's RX) with a jumper
+ */
+#define DISPLAY_BENCH_RX_PIN (1)
+#define DISPLAY_BENCH_ITERATIONS (20)
+
+/* Default profiler sampling period. Odd, so it doesn't beat with the loop */
+#define PROFILE_PERIOD_US (997)
+
 #define START_STOP_BTN_PIN (13)
 #define DOWN_BTN_PIN (14)
 #define UP_BTN_PIN (15)
 
+/*
+ * Optional external FRAM or EEPROM for settings, so that saving them doesn't
+ * stall the firmware like writing the internal flash does
+ */
+#ifdef PERSIST_I2C
+#define PERSIST_I2C_INST (i2c1)
+#define PERSIST_I2C_SDA_PIN (26)
+#define PERSIST_I2C_SCL_PIN (27)
+#define PERSIST_I2C_BAUD (400000)
+#endif
+
+/*
+ * A button edge after this long without one is the start of a new press or
+ * release, rather than bounce
+ */
+#define BUTTON_QUIET_US (20000)
+
+static volatile uint32_t button_first_edge[NUM_BANK0_GPIOS];
+static volatile uint32_t button_last_edge[NUM_BANK0_GPIOS];
+
+static void button_edge(unsigned int gpio, uint32_t events) {
+    uint32_t now = time_us_32();
+    if (now - button_last_edge[gpio] > BUTTON_QUIET_US) {
+        button_first_edge[gpio] = now;
+    }
+    button_last_edge[gpio] = now;
+}
+
 static struct button* make_button(int pin) {
     struct button* b = button_create(pin, true, 35);
     gpio_pull_up(pin);
     button_set_repeat(b, 1000, 500);
+    gpio_set_irq_enabled_with_callback(
+        pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true, button_edge);
     return b;
 }
 
+bool booting = true;
 bool run = false;
+bool benchmarking = false;
+/* Lowered when the steps can't keep up, until the motor is stopped */
+unsigned int rpm_limit = MAX_RPM;
 uint64_t run_time_start = 0;
 bool sleeping = false;
+unsigned int ramp_percent = 0;
 struct nhdk3z* display;
 struct stepper* motor;
 
 struct persist persist;
 
+enum metric {
+    METRIC_RPM,
+    METRIC_STEP_LATENESS,
+    METRIC_LOOP_TIME,
+    METRIC_TEMPERATURE,
+    /* Commanded coil PWM level, not measured */
+    METRIC_DRIVE,
+    NUM_METRICS,
+};
+
+static const char* const metric_names[NUM_METRICS] = {
+    [METRIC_RPM] = "rpm",
+    [METRIC_STEP_LATENESS] = "lateness_us",
+    [METRIC_LOOP_TIME] = "loop_us",
+    [METRIC_TEMPERATURE] = "temp_dc", /* Tenths of a degree C */
+    [METRIC_DRIVE] = "drive_pct",
+};
+
+struct rollup* metrics[NUM_METRICS];
+
+/*
+ * Delay from the physical button edge to the motor reacting, the display
+ * showing the result, and the settings being saved
+ */
+enum latency_type {
+    LATENCY_ACTUATION,
+    LATENCY_DISPLAY,
+    LATENCY_PERSIST,
+    NUM_LATENCIES,
+};
+
+struct latency* latencies[NUM_LATENCIES];
+bool latency_drawn = false;
+/*
+ * From standstill the motor reacts with its first step. When it is already
+ * turning, the next step was due anyway, so it reacts when its speed or target
+ * first changes
+ */
+bool actuation_from_rest = false;
+uint32_t actuation_interval_us = 0;
+
 struct hms {
     unsigned int hours;
     unsigned int minutes;
@@ -99,18 +264,40 @@ static struct hms us_to_hms(uint64_t us) {
     return result;
 }
 
+static unsigned int rpm_increment(unsigned int rpm, bool up) {
+    if (up ? rpm >= HIGH_SPEED_RPM : rpm > HIGH_SPEED_RPM) {
+        return RPM_STEP_HIGH;
+    }
+    return RPM_STEP;
+}
+
 static void set_target_rpm(unsigned int new_rpm) {
     new_rpm = MAX(new_rpm, RPM_STEP);
     new_rpm = MIN(new_rpm, MAX_RPM);
 
     persist.target_rpm = new_rpm;
     if (run) {
-        stepper_set_rpm(motor, persist.target_rpm);
+        unsigned int rpm = MIN(persist.target_rpm, rpm_limit);
+        if (rpm == stepper_get_rpm(motor)) {
+            /* Nothing for the motor to react to */
+            latency_cancel(latencies[LATENCY_ACTUATION]);
+        }
+        stepper_set_rpm(motor, rpm);
     }
 
     printf("Target RPM is now %" PRIu32 "\n", persist.target_rpm);
 }
 
+static void limit_rpm(void) {
+    unsigned int rpm = stepper_get_actual_rpm(motor);
+    unsigned int step = rpm_increment(rpm, false);
+
+    rpm_limit = rpm > RPM_STEP + step ? rpm - step : RPM_STEP;
+    stepper_set_rpm(motor, MIN(persist.target_rpm, rpm_limit));
+    printf("Steps can't keep up at %u RPM, limited to %u RPM\n", rpm,
+           rpm_limit);
+}
+
 static void update_display() {
     if (sleeping) {
         return;
@@ -123,17 +310,18 @@ static void update_display() {
 
         nhdk3z_printf(display, "Running %u:%02u:%02u", hms.hours, hms.minutes,
                       hms.seconds);
+    } else if (benchmarking) {
+        nhdk3z_write(display, "Speed test");
     } else {
         nhdk3z_write(display, "Stopped");
     }
     nhdk3z_set_cursor(display, 0x40);
-    nhdk3z_printf(display, "RPM %d", persist.target_rpm);
-    if (run) {
-        unsigned int actual_rpm = stepper_get_actual_rpm(motor);
-        if (actual_rpm && actual_rpm != persist.target_rpm) {
-            nhdk3z_printf(display, " (%d%%)",
-                          100 * actual_rpm / persist.target_rpm);
-        }
+    nhdk3z_printf(display, "RPM %d",
+                  benchmarking ? stepper_get_rpm(motor) : persist.target_rpm);
+    if (run && rpm_limit < persist.target_rpm) {
+        nhdk3z_printf(display, " max %d", rpm_limit);
+    } else if (run && ramp_percent && ramp_percent != 100) {
+        nhdk3z_printf(display, " (%d%%)", ramp_percent);
     }
 }
 
@@ -156,6 +344,255 @@ static void set_sleep(bool sleep) {
     }
 }
 
+/*
+ * Internal temperature sensor, in tenths of a degree C
+ */
+static int32_t read_temperature() {
+    adc_select_input(TEMPERATURE_ADC_INPUT);
+    int32_t mv = adc_read() * 3300 / 4096;
+    return 270 - (mv - 706) * 10000 / 1721;
+}
+
+static void print_bucket(char const* name, struct rollup_bucket const* b) {
+    printf("%s,%" PRIu32 ",%" PRIu32 ",%" PRId32 ",%" PRId32 ",%" PRId64 "\n",
+           name, b->index, b->count, b->min, b->max, b->sum / b->count);
+}
+
+/*
+ * Dumps the telemetry history as CSV, oldest first, with the bucket that is
+ * still being accumulated last. The dump can be hundreds of lines, which would
+ * hold up the steps, so the motor must be stopped
+ */
+static void cmd_rollup(void* ctx, int argc, char** argv) {
+    enum rollup_level level;
+
+    if (booting || run || benchmarking || stepper_get_actual_rpm(motor)) {
+        printf("The motor must be stopped\n");
+        return;
+    }
+
+    switch (argc > 1 ? argv[1][0] : '\0') {
+        case 's':
+            level = ROLLUP_SECONDS;
+            break;
+        case 'm':
+            level = ROLLUP_MINUTES;
+            break;
+        case 'h':
+            level = ROLLUP_HOURS;
+            break;
+        default:
+            printf("Usage: rollup s|m|h [METRIC]\n");
+            return;
+    }
+
+    printf("metric,index,count,min,max,mean\n");
+    for (int m = 0; m < NUM_METRICS; m++) {
+        struct rollup_bucket b;
+
+        if (argc > 2 && strcmp(argv[2], metric_names[m]) != 0) {
+            continue;
+        }
+
+        for (size_t n = 0; rollup_get(metrics[m], level, n, &b); n++) {
+            print_bucket(metric_names[m], &b);
+        }
+        if (rollup_get_current(metrics[m], level, &b)) {
+            print_bucket(metric_names[m], &b);
+        }
+    }
+}
+
+static void start_latency(unsigned int pin, bool actuation, bool persisted) {
+    uint32_t edge = button_first_edge[pin];
+
+    if (actuation) {
+        latency_start(latencies[LATENCY_ACTUATION], edge);
+        actuation_from_rest = stepper_get_actual_rpm(motor) == 0;
+        actuation_interval_us = stepper_get_step_interval_us(motor);
+    }
+    if (!sleeping) {
+        latency_start(latencies[LATENCY_DISPLAY], edge);
+        latency_drawn = false;
+    }
+    if (persisted) {
+        latency_start(latencies[LATENCY_PERSIST], edge);
+    }
+}
+
+static void cmd_latency(void* ctx, int argc, char** argv) {
+    bool reset = argc > 1 && strcmp(argv[1], "reset") == 0;
+
+    for (int n = 0; n < NUM_LATENCIES; n++) {
+        if (reset) {
+            latency_reset(latencies[n]);
+        } else {
+            latency_print(latencies[n]);
+        }
+    }
+}
+
+static void cmd_display_bench(void* ctx, int argc, char** argv) {
+    unsigned int iterations =
+        argc > 1 ? strtoul(argv[1], NULL, 0) : DISPLAY_BENCH_ITERATIONS;
+
+    /* It blocks the main loop, so the motor mustn't be moving */
+    if (booting || run || sleeping || benchmarking) {
+        printf("The motor must be stopped\n");
+        return;
+    }
+
+    display_bench_run(display, DISPLAY_UART, DISPLAY_BENCH_RX_PIN,
+                      MAX(iterations, 1));
+    update_display();
+}
+
+static void cmd_speed_bench(void* ctx, int argc, char** argv) {
+    struct speed_bench* bench = ctx;
+    unsigned int step_rpm =
+        argc > 1 ? strtoul(argv[1], NULL, 0) : RPM_STEP_HIGH;
+
+    if (booting || run || sleeping || benchmarking) {
+        printf("The motor must be stopped\n");
+        return;
+    }
+
+    speed_bench_start(bench, step_rpm, MAX_RPM, SPEED_BENCH_HOLD_US);
+    benchmarking = true;
+    update_display();
+}
+
+static void cmd_profile(void* ctx, int argc, char** argv) {
+    char const* op = argc > 1 ? argv[1] : "dump";
+
+    if (strcmp(op, "start") == 0) {
+        profiler_start(argc > 2 ? strtoul(argv[2], NULL, 0)
+                                : PROFILE_PERIOD_US);
+    } else if (strcmp(op, "stop") == 0) {
+        profiler_stop();
+    } else if (strcmp(op, "reset") == 0) {
+        profiler_reset();
+    } else {
+        profiler_dump();
+    }
+}
+
+/*
+ * Manual microstep calibration. The motor holds at each position of one
+ * electrical cycle in turn; the up and down buttons trim the coil drive until
+ * the rotor lines up with evenly spaced marks, and start/stop moves on to the
+ * next position. The trims are saved once every position is done
+ */
+static bool calibrate(struct pt* pt, struct button* up_button,
+                      struct button* down_button,
+                      struct button* start_stop_button) {
+    static unsigned int n;
+    static bool redraw;
+    unsigned int positions =
+        MIN(stepper_get_num_positions(motor), PERSIST_STEP_TRIM_COUNT);
+    int8_t* trim = &persist.step_trim[stepper_get_position(motor)];
+
+    PT_BEGIN(pt);
+    PT_WAIT_WHILE(pt, gpio_get(UP_BTN_PIN) == 0 || gpio_get(DOWN_BTN_PIN) == 0);
+
+    /* Discard the presses that entered calibration */
+    button_repeat(up_button);
+    button_repeat(down_button);
+
+    stepper_hold(motor);
+    for (n = 0; n < positions; n++) {
+        trim = &persist.step_trim[stepper_get_position(motor)];
+        redraw = true;
+
+        while (true) {
+            int delta = (int)button_repeat(up_button) -
+                        (int)button_repeat(down_button);
+            if (delta) {
+                *trim = MAX(MIN(*trim + delta, STEPPER_MAX_TRIM),
+                            -STEPPER_MAX_TRIM);
+                stepper_set_position_trim(motor, persist.step_trim,
+                                          PERSIST_STEP_TRIM_COUNT);
+                redraw = true;
+            }
+
+            if (button_up(start_stop_button)) {
+                break;
+            }
+
+            if (redraw) {
+                nhdk3z_clear(display);
+                nhdk3z_home(display);
+                nhdk3z_printf(display, "Calibrate %u/%u", n + 1, positions);
+                nhdk3z_set_cursor(display, 0x40);
+                nhdk3z_printf(display, "Trim %+d%%", *trim);
+                redraw = false;
+            }
+
+            PT_YIELD(pt);
+        }
+
+        stepper_step(motor, true);
+    }
+
+    write_persist(&persist);
+    PT_END(pt);
+}
+
+/*
+ * Start up, run from the main loop until it is done
+ */
+static bool boot(struct pt* pt, struct button* up_button,
+                 struct button* down_button,
+                 struct button* start_stop_button) {
+    static struct pt child;
+
+    PT_BEGIN(pt);
+    /* Wait for display to power up */
+    PT_SLEEP_US(pt, 1000000);
+
+    nhdk3z_set_baud(display, NHDK3Z_BAUD_57600);
+    nhdk3z_set_display_on(display, true);
+    nhdk3z_set_contrast(display, 50);
+    nhdk3z_set_brightness(display, 8);
+    nhdk3z_set_cursor_blink(display, false);
+    nhdk3z_set_cursor_underline(display, false);
+    nhdk3z_clear(display);
+    nhdk3z_home(display);
+    nhdk3z_printf(display, "Version %s", VERSION);
+    PT_SLEEP_US(pt, 2000000);
+
+    stepper_enable(motor, true);
+
+    /* Holding up and down during boot enters calibration */
+    if (gpio_get(UP_BTN_PIN) == 0 && gpio_get(DOWN_BTN_PIN) == 0) {
+        PT_SPAWN(pt, &child,
+                 calibrate(&child, up_button, down_button, start_stop_button));
+    }
+
+    stepper_set_accel(motor, MOTOR_ACCEL, RPM_STEP);
+    stepper_set_ramp_event_percent(motor, RAMP_PERCENT_STEP);
+    stepper_enable(motor, true);
+    stepper_hold(motor);
+    update_display();
+    gpio_put(FAN_PIN, 1);
+    PT_END(pt);
+}
+
+/*
+ * Entered by holding start/stop. The release that ends the hold mustn't wake
+ * it straight back up
+ */
+static bool enter_sleep(struct pt* pt, struct button* start_stop_button) {
+    PT_BEGIN(pt);
+    nhdk3z_clear(display);
+    nhdk3z_home(display);
+    nhdk3z_write(display, "Sleeping...");
+    PT_SLEEP_US(pt, 1000000);
+    set_sleep(true);
+    PT_WAIT_WHILE(pt, button_is_pressed(start_stop_button));
+    PT_END(pt);
+}
+
 static uint32_t pwm_set_freq_duty(unsigned int slice_num, unsigned int chan,
                                   uint32_t frequency, int duty) {
     uint32_t clock = 125000000;
@@ -176,9 +613,20 @@ int main() {
     gpio_init(LED_PIN);
     gpio_set_dir(LED_PIN, GPIO_OUT);
     gpio_put(LED_PIN, 1);
+    scope_init();
     printf("Booting...");
-    /* Wait for display to power up */
-    sleep_ms(1000);
+
+#ifdef PERSIST_I2C
+    static struct persist_storage storage;
+    struct i2cmem* mem = i2cmem_create(PERSIST_I2C_INST, PERSIST_I2C_BAUD,
+                                       PERSIST_I2C_ADDR, PERSIST_I2C_PAGE_SIZE);
+    gpio_set_function(PERSIST_I2C_SDA_PIN, GPIO_FUNC_I2C);
+    gpio_set_function(PERSIST_I2C_SCL_PIN, GPIO_FUNC_I2C);
+    gpio_pull_up(PERSIST_I2C_SDA_PIN);
+    gpio_pull_up(PERSIST_I2C_SCL_PIN);
+    i2cmem_get_storage(mem, &storage);
+    persist_set_storage(&storage);
+#endif
     read_persist(&persist);
 
     /* Buttons */
@@ -210,36 +658,73 @@ int main() {
         pwm_mask |= 1 << slice_num;
     }
     pwm_set_mask_enabled(pwm_mask);
+    stepper_set_pwm_ramp(motor, MOTOR_RAMP_PERIODS);
+    stepper_set_speed_bands(motor, motor_speed_bands,
+                            ARRAY_COUNT(motor_speed_bands));
+    stepper_set_position_trim(motor, persist.step_trim,
+                              PERSIST_STEP_TRIM_COUNT);
+    stepper_set_clock_trim(motor, persist.clock_trim_ppb);
 
     /* Display */
     display = nhdk3z_create(DISPLAY_UART);
     gpio_set_function(DISPLAY_PIN, GPIO_FUNC_UART);
-    nhdk3z_set_baud(display, NHDK3Z_BAUD_57600);
 
-    nhdk3z_set_display_on(display, true);
-    nhdk3z_set_contrast(display, 50);
-    nhdk3z_set_brightness(display, 8);
-    nhdk3z_set_cursor_blink(display, false);
-    nhdk3z_set_cursor_underline(display, false);
-    nhdk3z_clear(display);
-    nhdk3z_home(display);
-    nhdk3z_printf(display, "Version %s", VERSION);
-    sleep_ms(2000);
+    /* Telemetry */
+    adc_init();
+    adc_set_temp_sensor_enabled(true);
+    for (int m = 0; m < NUM_METRICS; m++) {
+        metrics[m] = rollup_create();
+    }
 
-    stepper_set_accel(motor, MOTOR_ACCEL, RPM_STEP);
-    stepper_enable(motor, true);
-    stepper_hold(motor);
-    update_display();
-    gpio_put(FAN_PIN, 1);
+    struct timebase* timebase = timebase_create();
+
+    latencies[LATENCY_ACTUATION] = latency_create("actuation");
+    latencies[LATENCY_DISPLAY] = latency_create("display");
+    latencies[LATENCY_PERSIST] = latency_create("persist");
+
+    struct console* console = console_create();
+    console_add_command(console, "rollup", "Dump telemetry history",
+                        cmd_rollup, NULL);
+    console_add_command(console, "latency",
+                        "Show (or reset) button to output latencies",
+                        cmd_latency, NULL);
+    console_add_command(console, "dispbench",
+                        "Benchmark the display driver (needs TX looped to RX)",
+                        cmd_display_bench, NULL);
+    console_add_command(console, "profile",
+                        "PC sampling profiler: start [us], stop, reset, dump",
+                        cmd_profile, NULL);
+
+    struct speed_bench* speed_bench =
+        speed_bench_create(motor, STEPS_PER_REV * 2);
+    console_add_command(console, "speedbench",
+                        "Measure step timing up to the maximum speed, in "
+                        "steps of [rpm]",
+                        cmd_speed_bench, speed_bench);
+
+    struct pt boot_pt;
+    PT_INIT(&boot_pt);
+
+    struct pt sleep_pt;
+    bool entering_sleep = false;
 
     uint64_t sleep_start = time_us_64();
     int run_time_sec = 0;
+    uint64_t last_loop = time_us_64();
+    uint64_t next_sample = last_loop;
+    uint64_t last_step_count = stepper_step_count(motor);
+    uint64_t late_since = 0;
+    int32_t clock_trim_ppb = persist.clock_trim_ppb;
 
     while (true) {
         uint64_t now = time_us_64();
         bool redraw = false;
 
-        if (!run && !sleeping && now >= sleep_start + SLEEP_TIMEOUT_US) {
+        rollup_add(metrics[METRIC_LOOP_TIME], now, now - last_loop);
+        last_loop = now;
+
+        if (!booting && !run && !sleeping &&
+            now >= sleep_start + SLEEP_TIMEOUT_US) {
             set_sleep(true);
         }
 
@@ -255,42 +740,173 @@ int main() {
         }
 
         gpio_put(LED_PIN, stepper_update(motor) ? 1 : 0);
+        nhdk3z_update(display);
+        switch (persist_update()) {
+            case PERSIST_IDLE:
+                latency_stop(latencies[LATENCY_PERSIST], time_us_32());
+                break;
+
+            case PERSIST_FAILED:
+                latency_cancel(latencies[LATENCY_PERSIST]);
+                break;
+
+            case PERSIST_WRITING:
+                break;
+        }
+
+        if (!actuation_from_rest &&
+            stepper_get_step_interval_us(motor) != actuation_interval_us) {
+            latency_stop(latencies[LATENCY_ACTUATION], time_us_32());
+        }
+
+        if (stepper_step_count(motor) != last_step_count) {
+            last_step_count = stepper_step_count(motor);
+            if (actuation_from_rest) {
+                latency_stop(latencies[LATENCY_ACTUATION], time_us_32());
+            }
+
+            uint32_t lateness = stepper_get_lateness_us(motor);
+            uint32_t late_limit = (uint64_t)stepper_get_step_interval_us(
+                                      motor) *
+                                  LATE_LIMIT_PERCENT / 100;
+            rollup_add(metrics[METRIC_STEP_LATENESS], now, lateness);
+            if (lateness <= late_limit) {
+                late_since = 0;
+            } else if (!late_since) {
+                late_since = now;
+            } else if (run && now - late_since >= LATE_LIMIT_US) {
+                limit_rpm();
+                late_since = 0;
+                redraw = true;
+            }
+        }
+
+        if (benchmarking && !speed_bench_update(speed_bench)) {
+            benchmarking = false;
+            redraw = true;
+        }
+
+        if (now >= next_sample) {
+            next_sample = now + TELEMETRY_SAMPLE_US;
+            rollup_add(metrics[METRIC_RPM], now,
+                       stepper_get_actual_rpm(motor));
+            rollup_add(metrics[METRIC_TEMPERATURE], now, read_temperature());
+            rollup_add(metrics[METRIC_DRIVE], now,
+                       sleeping ? 0
+                                : MOTOR_DUTY_CYCLE *
+                                      stepper_get_drive_percent(motor) / 100);
+        }
+
+        if (timebase_update(timebase, &clock_trim_ppb)) {
+            printf("Timer error is %" PRId32 " ppb\n", clock_trim_ppb);
+            stepper_set_clock_trim(motor, clock_trim_ppb);
+        }
+
+        if (!booting && !run && !benchmarking &&
+            stepper_get_actual_rpm(motor) == 0 &&
+            abs(clock_trim_ppb - persist.clock_trim_ppb) >
+                CLOCK_TRIM_SAVE_PPB) {
+            persist.clock_trim_ppb = clock_trim_ppb;
+            write_persist(&persist);
+        }
+
+        console_update(console);
+
+        struct stepper_event event;
+        while (stepper_get_event(motor, &event)) {
+            switch (event.type) {
+                case STEPPER_EVENT_TARGET_REACHED:
+                    ramp_percent = 100;
+                    if (!actuation_from_rest) {
+                        latency_stop(latencies[LATENCY_ACTUATION],
+                                     time_us_32());
+                    }
+                    redraw = true;
+                    break;
+
+                case STEPPER_EVENT_RAMP_PERCENT:
+                    ramp_percent = event.value;
+                    if (!actuation_from_rest) {
+                        latency_stop(latencies[LATENCY_ACTUATION],
+                                     time_us_32());
+                    }
+                    redraw = true;
+                    break;
+
+                case STEPPER_EVENT_STOPPED:
+                    ramp_percent = 0;
+                    latency_stop(latencies[LATENCY_ACTUATION], time_us_32());
+                    break;
+
+                case STEPPER_EVENT_FAULT:
+                    printf("Missed %u steps at step %" PRIu64 "\n",
+                           event.value, event.step_count);
+                    break;
+
+                case STEPPER_EVENT_POSITION_REACHED:
+                    break;
+            }
+        }
+
+        SCOPE_BEGIN(BUTTON);
         button_update(up_button);
         button_update(down_button);
         button_update(start_stop_button);
+        SCOPE_END(BUTTON);
+
+        if (booting) {
+            if (boot(&boot_pt, up_button, down_button, start_stop_button)) {
+                continue;
+            }
+            booting = false;
+            sleep_start = now;
+        }
 
-        if (sleeping) {
+        if (entering_sleep) {
+            entering_sleep = enter_sleep(&sleep_pt, start_stop_button);
+        } else if (benchmarking) {
+            if (button_up(start_stop_button)) {
+                speed_bench_stop(speed_bench);
+            }
+            sleep_start = now;
+        } else if (sleeping) {
             if (button_up(up_button) || button_up(down_button) ||
                 button_up(start_stop_button)) {
                 set_sleep(false);
                 sleep_start = now;
             }
         } else {
+            if (button_down(up_button)) {
+                start_latency(UP_BTN_PIN, run, false);
+            }
+            if (button_down(down_button)) {
+                start_latency(DOWN_BTN_PIN, run, false);
+            }
+
             if (button_repeat(up_button)) {
-                set_target_rpm(persist.target_rpm + RPM_STEP);
+                set_target_rpm(persist.target_rpm +
+                               rpm_increment(persist.target_rpm, true));
                 sleep_start = now;
                 redraw = true;
             }
 
             if (button_repeat(down_button)) {
-                set_target_rpm(persist.target_rpm - RPM_STEP);
+                set_target_rpm(persist.target_rpm -
+                               rpm_increment(persist.target_rpm, false));
                 sleep_start = now;
                 redraw = true;
             }
 
             if (!run && button_is_pressed(start_stop_button) &&
                 button_current_duration_us(start_stop_button) >= 4000000) {
-                nhdk3z_clear(display);
-                nhdk3z_home(display);
-                nhdk3z_write(display, "Sleeping...");
-                sleep_ms(1000);
-                set_sleep(true);
-                while (!button_up(start_stop_button)) {
-                    button_update(start_stop_button);
-                }
+                PT_INIT(&sleep_pt);
+                entering_sleep = enter_sleep(&sleep_pt, start_stop_button);
             } else if (button_up(start_stop_button)) {
+                /* Only measured if there is something to save */
+                bool saving = write_persist(&persist);
+                start_latency(START_STOP_BTN_PIN, true, saving);
                 run = !run;
-                write_persist(&persist);
+                rpm_limit = MAX_RPM;
                 if (run) {
                     stepper_set_rpm(motor, persist.target_rpm);
                     run_time_start = now;
@@ -305,6 +921,12 @@ int main() {
 
         if (redraw) {
             update_display();
+            latency_drawn = latency_pending(latencies[LATENCY_DISPLAY]);
+        }
+
+        if (latency_drawn && !nhdk3z_busy(display)) {
+            latency_stop(latencies[LATENCY_DISPLAY], time_us_32());
+            latency_drawn = false;
         }
     }
 
@@ -14,15 +14,80 @@
 #include <string.h>
 
 #include "pico/stdlib.h"
+#include "pt.h"
+#include "scope.h"
 
+/* Must be a power of 2 */
+#define TX_BUFFER_SIZE (256)
+
+/* Time for the display to switch to a new baud rate */
+#define BAUD_SETTLE_US (20)
+
+/*
+ * Output is queued and fed to the UART FIFO by nhdk3z_update(), so drawing
+ * doesn't wait for the bytes to go out
+ */
 struct nhdk3z {
     uart_inst_t* uart;
+    struct pt pt;
+
+    uint8_t tx[TX_BUFFER_SIZE];
+    unsigned int head;
+    unsigned int tail;
+
+    /* Baud rate change, made once the output before it has been sent */
+    bool baud_pending;
+    unsigned int baud_at;
+    unsigned int baud_rate;
 };
 
+static bool pump(struct nhdk3z* d) {
+    PT_BEGIN(&d->pt);
+    while (true) {
+        if (d->tail != d->head && uart_is_writable(d->uart)) {
+            SCOPE_BEGIN(DISPLAY);
+            while (d->tail != d->head &&
+                   !(d->baud_pending && d->tail == d->baud_at) &&
+                   uart_is_writable(d->uart)) {
+                uart_putc_raw(d->uart, d->tx[d->tail++ % TX_BUFFER_SIZE]);
+            }
+            SCOPE_END(DISPLAY);
+        }
+
+        if (d->baud_pending && d->tail == d->baud_at) {
+            PT_WAIT_WHILE(&d->pt,
+                          uart_get_hw(d->uart)->fr & UART_UARTFR_BUSY_BITS);
+            uart_set_baudrate(d->uart, d->baud_rate);
+            PT_SLEEP_US(&d->pt, BAUD_SETTLE_US);
+            d->baud_pending = false;
+        } else {
+            PT_YIELD(&d->pt);
+        }
+    }
+    PT_END(&d->pt);
+}
+
+/*
+ * If the queue is full, this has to wait for space. Nothing draws anywhere
+ * near that much at once
+ */
+static void queue(struct nhdk3z* d, void const* data, size_t len) {
+    uint8_t const* p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        while (d->head - d->tail == TX_BUFFER_SIZE) {
+            nhdk3z_update(d);
+        }
+        d->tx[d->head++ % TX_BUFFER_SIZE] = p[i];
+    }
+    nhdk3z_update(d);
+}
+
 struct nhdk3z* nhdk3z_create(uart_inst_t* uart) {
     struct nhdk3z* d = calloc(1, sizeof(*d));
 
     d->uart = uart;
+    PT_INIT(&d->pt);
     uart_init(uart, 9600);
     uart_set_hw_flow(uart, false, false);
     uart_set_format(uart, 8, 1, UART_PARITY_NONE);
@@ -37,39 +102,58 @@ void nhdk3z_free(struct nhdk3z* d) {
 
 void nhdk3z_set_baud(struct nhdk3z* d, enum nhdk3z_baud baud) {
     const uint8_t cmd[] = {0xfe, 0x61, baud};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
-    uart_tx_wait_blocking(d->uart);
+
+    while (d->baud_pending) {
+        nhdk3z_update(d);
+    }
+
     switch (baud) {
         case NHDK3Z_BAUD_300:
-            uart_set_baudrate(d->uart, 300);
+            d->baud_rate = 300;
             break;
         case NHDK3Z_BAUD_1200:
-            uart_set_baudrate(d->uart, 1200);
+            d->baud_rate = 1200;
             break;
         case NHDK3Z_BAUD_2400:
-            uart_set_baudrate(d->uart, 2400);
+            d->baud_rate = 2400;
             break;
         case NHDK3Z_BAUD_9600:
-            uart_set_baudrate(d->uart, 9600);
+            d->baud_rate = 9600;
             break;
         case NHDK3Z_BAUD_14400:
-            uart_set_baudrate(d->uart, 14400);
+            d->baud_rate = 14400;
             break;
         case NHDK3Z_BAUD_19200:
-            uart_set_baudrate(d->uart, 19200);
+            d->baud_rate = 19200;
             break;
         case NHDK3Z_BAUD_57600:
-            uart_set_baudrate(d->uart, 57600);
+            d->baud_rate = 57600;
             break;
         case NHDK3Z_BAUD_115200:
-            uart_set_baudrate(d->uart, 115200);
+            d->baud_rate = 115200;
             break;
     }
-    sleep_us(20);
+
+    queue(d, cmd, sizeof(cmd));
+    d->baud_at = d->head;
+    d->baud_pending = true;
+    nhdk3z_update(d);
+}
+
+bool nhdk3z_update(struct nhdk3z* d) {
+    pump(d);
+    return d->head != d->tail || d->baud_pending;
+}
+
+size_t nhdk3z_queued(struct nhdk3z const* d) { return d->head - d->tail; }
+
+bool nhdk3z_busy(struct nhdk3z const* d) {
+    return d->head != d->tail || d->baud_pending ||
+           (uart_get_hw(d->uart)->fr & UART_UARTFR_BUSY_BITS);
 }
 
 void nhdk3z_write(struct nhdk3z* d, char const* s) {
-    uart_write_blocking(d->uart, (uint8_t const*)s, strlen(s));
+    queue(d, s, strlen(s));
 }
 
 void nhdk3z_vprintf(struct nhdk3z* d, char const* format, va_list args) {
@@ -93,24 +177,24 @@ void nhdk3z_printf(struct nhdk3z* d, char const* format, ...) {
 
 void nhdk3z_clear(struct nhdk3z* d) {
     static const uint8_t cmd[] = {0xfe, 0x51};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_home(struct nhdk3z* d) {
     static const uint8_t cmd[] = {0xfe, 0x46};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_cursor(struct nhdk3z* d, uint8_t pos) {
     const uint8_t cmd[] = {0xfe, 0x45, pos};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_contrast(struct nhdk3z* d, uint8_t contrast) {
     contrast = MIN(contrast, 50);
     contrast = MAX(contrast, 1);
     const uint8_t cmd[] = {0xfe, 0x52, contrast};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_brightness(struct nhdk3z* d, uint8_t brightness) {
@@ -118,21 +202,21 @@ void nhdk3z_set_brightness(struct nhdk3z* d, uint8_t brightness) {
     brightness = MAX(brightness, 1);
 
     const uint8_t cmd[] = {0xfe, 0x53, brightness};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_cursor_blink(struct nhdk3z* d, bool blink) {
     const uint8_t cmd[] = {0xfe, blink ? 0x4b : 0x4c};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_cursor_underline(struct nhdk3z* d, bool underline) {
     const uint8_t cmd[] = {0xfe, underline ? 0x47 : 0x48};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
 void nhdk3z_set_display_on(struct nhdk3z* d, bool on) {
     const uint8_t cmd[] = {0xfe, on ? 0x41 : 0x42};
-    uart_write_blocking(d->uart, cmd, sizeof(cmd));
+    queue(d, cmd, sizeof(cmd));
 }
 
@@ -10,6 +10,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "pico/stdlib.h"
 
@@ -28,7 +29,16 @@ struct nhdk3z;
 
 struct nhdk3z* nhdk3z_create(uart_inst_t* uart);
 void nhdk3z_free(struct nhdk3z* d);
+/*
+ * Output is queued, and sent as nhdk3z_update() is called. It returns true
+ * while there is still output queued
+ */
+bool nhdk3z_update(struct nhdk3z* d);
 void nhdk3z_set_baud(struct nhdk3z* d, enum nhdk3z_baud baud);
+/* Number of bytes waiting to be sent */
+size_t nhdk3z_queued(struct nhdk3z const* d);
+/* True until everything written so far has been sent to the display */
+bool nhdk3z_busy(struct nhdk3z const* d);
 void nhdk3z_write(struct nhdk3z* d, char const* s);
 void nhdk3z_vprintf(struct nhdk3z* d, char const* format, va_list args);
 void nhdk3z_printf(struct nhdk3z* d, char const* format, ...);
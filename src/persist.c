@@ -10,6 +10,8 @@
 
 #include "hardware/flash.h"
 #include "hardware/sync.h"
+#include "pt.h"
+#include "scope.h"
 
 #define ROUND_UP(_size, _factor) \
     (((_size) + (_factor) - 1) - ((_size) + (_factor) - 1) % (_factor))
@@ -18,34 +20,137 @@
     {                    \
         PERSIST_VERSION, \
         20,              \
+        {0},             \
+        0,               \
     }
 
 #define PERSIST_OFFSET ((uintptr_t)(&persist) - XIP_BASE)
 
+#define FLASH_PERSIST_SIZE ROUND_UP(sizeof(struct persist), FLASH_PAGE_SIZE)
+
 static struct persist __attribute__((section(".section_persist"))) persist =
     DEFAULT_PERSIST;
 
+/*
+ * Internal flash storage. Erasing and programming each stall XIP (and
+ * therefore everything) until they are done, so a commit does them on
+ * separate calls to flash_update() to let the main loop run in between
+ */
+static uint8_t flash_buffer[FLASH_PERSIST_SIZE];
+static struct pt flash_pt;
+static bool flash_committing;
+
+static bool flash_commit(struct pt* pt) {
+    uint32_t interrupts;
+
+    PT_BEGIN(pt);
+
+    SCOPE_BEGIN(FLASH);
+    interrupts = save_and_disable_interrupts();
+    flash_range_erase(PERSIST_OFFSET,
+                      ROUND_UP(sizeof(flash_buffer), FLASH_SECTOR_SIZE));
+    restore_interrupts(interrupts);
+    SCOPE_END(FLASH);
+
+    PT_YIELD(pt);
+
+    /* Programs the newest data, even if it changed since the erase */
+    SCOPE_BEGIN(FLASH);
+    interrupts = save_and_disable_interrupts();
+    flash_range_program(PERSIST_OFFSET, flash_buffer, sizeof(flash_buffer));
+    restore_interrupts(interrupts);
+    SCOPE_END(FLASH);
+
+    PT_END(pt);
+}
+
+static bool flash_read(void* ctx, uint32_t offset, void* buffer, size_t len) {
+    if (offset + len > sizeof(persist)) {
+        return false;
+    }
+    memcpy(buffer,
+           (flash_committing ? flash_buffer : (uint8_t const*)&persist) +
+               offset,
+           len);
+    return true;
+}
+
+static bool flash_write(void* ctx, uint32_t offset, void const* data,
+                        size_t len) {
+    if (offset + len > sizeof(flash_buffer)) {
+        return false;
+    }
+
+    if (flash_committing) {
+        memcpy(flash_buffer + offset, data, len);
+        return true;
+    }
+
+    memset(flash_buffer, 0xFF, sizeof(flash_buffer));
+    memcpy(flash_buffer, &persist, sizeof(persist));
+    memcpy(flash_buffer + offset, data, len);
+
+    if (memcmp(flash_buffer, &persist, sizeof(persist)) != 0) {
+        PT_INIT(&flash_pt);
+        flash_committing = true;
+    }
+    return true;
+}
+
+static enum persist_status flash_update(void* ctx) {
+    if (flash_committing) {
+        flash_committing = flash_commit(&flash_pt);
+    }
+    return flash_committing ? PERSIST_WRITING : PERSIST_IDLE;
+}
+
+static const struct persist_storage flash_storage = {
+    .read = flash_read,
+    .write = flash_write,
+    .update = flash_update,
+};
+
+static struct persist_storage const* storage = &flash_storage;
+
+/* Last settings read or written, to skip writing when nothing changed */
+static struct persist last;
+
+void persist_set_storage(struct persist_storage const* s) {
+    storage = s ? s : &flash_storage;
+}
+
 void read_persist(struct persist* p) {
-    if (persist.version != PERSIST_VERSION) {
+    if (!storage->read(storage->ctx, 0, p, sizeof(*p)) ||
+        p->version != PERSIST_VERSION) {
         static const struct persist default_persist = DEFAULT_PERSIST;
         *p = default_persist;
-        return;
     }
-    *p = persist;
+    last = *p;
 }
 
-void write_persist(struct persist const* p) {
-    uint8_t buffer[ROUND_UP(sizeof(*p), FLASH_PAGE_SIZE)];
+/* Returns true if a write was queued */
+bool write_persist(struct persist const* p) {
+    if (memcmp(p, &last, sizeof(*p)) == 0) {
+        return false;
+    }
+    if (!storage->write(storage->ctx, 0, p, sizeof(*p))) {
+        printf("Settings not saved, storage is busy\n");
+        return false;
+    }
+    last = *p;
+    return true;
+}
 
-    memset(buffer, 0xFF, sizeof(buffer));
-    memcpy(buffer, p, sizeof(*p));
+enum persist_status persist_update(void) {
+    if (!storage->update) {
+        return PERSIST_IDLE;
+    }
 
-    if (memcmp(buffer, &persist, sizeof(persist)) != 0) {
-        uint32_t interrupts = save_and_disable_interrupts();
-        flash_range_erase(PERSIST_OFFSET,
-                          ROUND_UP(sizeof(buffer), FLASH_SECTOR_SIZE));
-        flash_range_program(PERSIST_OFFSET, buffer, sizeof(buffer));
-        restore_interrupts(interrupts);
+    enum persist_status status = storage->update(storage->ctx);
+    if (status == PERSIST_FAILED) {
+        /* Make the next write_persist() try again */
+        printf("Saving settings failed\n");
+        memset(&last, 0xFF, sizeof(last));
     }
+    return status;
 }
-
@@ -6,17 +6,51 @@
 #ifndef _PERSIST_H
 #define _PERSIST_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define PERSIST_VERSION 1
+#define PERSIST_VERSION 3
+
+/* Positions in one electrical cycle of the motor in half step mode */
+#define PERSIST_STEP_TRIM_COUNT 8
 
 struct persist {
     uint32_t version;
     uint32_t target_rpm;
+    int8_t step_trim[PERSIST_STEP_TRIM_COUNT];
+    /* Measured system timer error, in parts per billion */
+    int32_t clock_trim_ppb;
+};
+
+enum persist_status {
+    PERSIST_IDLE,
+    PERSIST_WRITING,
+    /* A write couldn't be completed. Reported once */
+    PERSIST_FAILED,
+};
+
+/*
+ * Backing store for the settings. Offsets are relative to the start of the
+ * settings area
+ */
+struct persist_storage {
+    bool (*read)(void* ctx, uint32_t offset, void* buffer, size_t len);
+    /*
+     * May return before the data is written; see update. Returns false if
+     * the write was rejected
+     */
+    bool (*write)(void* ctx, uint32_t offset, void const* data, size_t len);
+    /* Optional. Advances any write in progress */
+    enum persist_status (*update)(void* ctx);
+    void* ctx;
 };
 
+/* Selects where settings are kept. NULL selects the internal flash */
+void persist_set_storage(struct persist_storage const* storage);
 void read_persist(struct persist* p);
-void write_persist(struct persist const* p);
+bool write_persist(struct persist const* p);
+enum persist_status persist_update(void);
 
 #endif
 
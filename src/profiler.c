@@ -0,0 +1,172 @@
+/*
+ * Statistical PC-sampling profiler for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "profiler.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hardware/irq.h"
+#include "hardware/structs/timer.h"
+#include "hardware/timer.h"
+#include "pico/stdlib.h"
+
+#define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#define ROM_BUCKETS (256)
+#define FLASH_BUCKETS (4096)
+#define RAM_BUCKETS (1024)
+
+/* Offset of the return address in the exception stack frame, in words */
+#define FRAME_PC (6)
+
+extern char __flash_binary_start;
+extern char __flash_binary_end;
+
+/*
+ * Each sample is binned by the interrupted program counter into one of these
+ * regions. The bucket size is the smallest power of 2 that covers the region
+ * with the available buckets
+ */
+struct region {
+    char const* name;
+    uintptr_t base;
+    uintptr_t size;
+    unsigned int shift;
+    uint32_t* counts;
+    size_t num_buckets;
+};
+
+static uint32_t rom_counts[ROM_BUCKETS];
+static uint32_t flash_counts[FLASH_BUCKETS];
+static uint32_t ram_counts[RAM_BUCKETS];
+
+static struct region regions[] = {
+    {"rom", ROM_BASE, 16 * 1024, 0, rom_counts, ROM_BUCKETS},
+    {"flash", 0, 0, 0, flash_counts, FLASH_BUCKETS},
+    {"ram", SRAM_BASE, 264 * 1024, 0, ram_counts, RAM_BUCKETS},
+};
+
+static int alarm_num = -1;
+static uint32_t period;
+static uint32_t samples;
+static uint32_t other;
+
+/*
+ * Called from the interrupt with the exception stack frame of whatever was
+ * interrupted
+ */
+static void __attribute__((used)) __not_in_flash_func(profiler_sample)(
+    uint32_t const* frame) {
+    uintptr_t pc = frame[FRAME_PC];
+
+    timer_hw->intr = 1u << alarm_num;
+    timer_hw->alarm[alarm_num] = timer_hw->timerawl + period;
+
+    samples++;
+    for (size_t i = 0; i < ARRAY_COUNT(regions); i++) {
+        struct region* r = &regions[i];
+        if (pc - r->base < r->size) {
+            r->counts[(pc - r->base) >> r->shift]++;
+            return;
+        }
+    }
+    other++;
+}
+
+/*
+ * The interrupted code may have been using either stack; bit 2 of the
+ * exception return value in LR says which one the frame was pushed to
+ */
+static void __attribute__((naked)) __not_in_flash_func(profiler_isr)(void) {
+    __asm volatile(
+        "movs r0, #4\n"
+        "mov r1, lr\n"
+        "tst r0, r1\n"
+        "beq 1f\n"
+        "mrs r0, psp\n"
+        "b 2f\n"
+        "1:\n"
+        "mrs r0, msp\n"
+        "2:\n"
+        "ldr r1, 3f\n"
+        "bx r1\n"
+        ".align 2\n"
+        "3: .word profiler_sample\n");
+}
+
+/*
+ * The sampling interrupt has a higher priority than the USB, timer and button
+ * interrupts, so samples land inside their handlers and their time is charged
+ * to them rather than to the code they interrupted. The handler runs from RAM
+ * and is only a few instructions, so it barely delays them
+ */
+void profiler_start(uint32_t period_us) {
+    if (alarm_num < 0) {
+        regions[1].base = (uintptr_t)&__flash_binary_start;
+        regions[1].size =
+            (uintptr_t)&__flash_binary_end - (uintptr_t)&__flash_binary_start;
+
+        for (size_t i = 0; i < ARRAY_COUNT(regions); i++) {
+            struct region* r = &regions[i];
+            while ((r->size >> r->shift) >= r->num_buckets) {
+                r->shift++;
+            }
+        }
+
+        alarm_num = hardware_alarm_claim_unused(true);
+        irq_set_exclusive_handler(TIMER_IRQ_0 + alarm_num, profiler_isr);
+        irq_set_priority(TIMER_IRQ_0 + alarm_num, PICO_HIGHEST_IRQ_PRIORITY);
+        hw_set_bits(&timer_hw->inte, 1u << alarm_num);
+    }
+
+    period = MAX(period_us, 10);
+    timer_hw->alarm[alarm_num] = timer_hw->timerawl + period;
+    irq_set_enabled(TIMER_IRQ_0 + alarm_num, true);
+}
+
+void profiler_stop(void) {
+    if (alarm_num < 0) {
+        return;
+    }
+    irq_set_enabled(TIMER_IRQ_0 + alarm_num, false);
+    timer_hw->armed = 1u << alarm_num;
+    timer_hw->intr = 1u << alarm_num;
+}
+
+void profiler_reset(void) {
+    for (size_t i = 0; i < ARRAY_COUNT(regions); i++) {
+        memset(regions[i].counts, 0,
+               regions[i].num_buckets * sizeof(*regions[i].counts));
+    }
+    samples = 0;
+    other = 0;
+}
+
+/*
+ * Prints the histogram for tools/profile-report.py to resolve against the
+ * ELF symbols. Only buckets with samples are printed
+ */
+void profiler_dump(void) {
+    printf("profile,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n", period, samples,
+           other);
+    for (size_t i = 0; i < ARRAY_COUNT(regions); i++) {
+        struct region const* r = &regions[i];
+
+        printf("region,%s,0x%08" PRIxPTR ",%u\n", r->name, r->base, r->shift);
+        for (size_t n = 0; n < r->num_buckets; n++) {
+            if (r->counts[n]) {
+                printf("0x%08" PRIxPTR ",%" PRIu32 "\n",
+                       r->base + (n << r->shift), r->counts[n]);
+            }
+        }
+    }
+    printf("end\n");
+}
@@ -0,0 +1,18 @@
+/*
+ * Statistical PC-sampling profiler for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdint.h>
+
+void profiler_start(uint32_t period_us);
+void profiler_stop(void);
+void profiler_reset(void);
+void profiler_dump(void);
+
+#endif
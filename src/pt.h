@@ -0,0 +1,98 @@
+/*
+ * Protothreads for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _PT_H_
+#define _PT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+
+/*
+ * Stackless coroutines in the style of Adam Dunkels' protothreads. A thread is
+ * a function that takes a struct pt and returns true while it is still
+ * running; it is resumed by calling it again (usually from the main loop),
+ * and continues from the point where it last waited.
+ *
+ * Because the function returns at every wait, local variables do not survive
+ * a wait (use static variables or a context struct), a thread can't wait
+ * inside a switch statement of its own, and only one wait may appear on a
+ * line.
+ *
+ * For example:
+ *
+ *  static bool blink(struct pt* pt) {
+ *      PT_BEGIN(pt);
+ *      while (true) {
+ *          gpio_put(LED_PIN, 1);
+ *          PT_SLEEP_US(pt, 500000);
+ *          gpio_put(LED_PIN, 0);
+ *          PT_SLEEP_US(pt, 500000);
+ *      }
+ *      PT_END(pt);
+ *  }
+ */
+struct pt {
+    unsigned int lc;
+    uint64_t wake;
+};
+
+#define PT_LC_ENDED (~0u)
+
+#define PT_INIT(_pt) ((_pt)->lc = 0)
+#define PT_RUNNING(_pt) ((_pt)->lc != PT_LC_ENDED)
+
+#define PT_BEGIN(_pt)    \
+    switch ((_pt)->lc) { \
+        case 0:
+
+#define PT_END(_pt)          \
+    }                        \
+    (_pt)->lc = PT_LC_ENDED; \
+    return false;
+
+/* Ends the thread early */
+#define PT_EXIT(_pt)             \
+    do {                         \
+        (_pt)->lc = PT_LC_ENDED; \
+        return false;            \
+    } while (0)
+
+/* Gives the rest of the main loop a turn */
+#define PT_YIELD(_pt)         \
+    do {                      \
+        (_pt)->lc = __LINE__; \
+        return true;          \
+        case __LINE__:;       \
+    } while (0)
+
+#define PT_WAIT_UNTIL(_pt, _cond) \
+    do {                          \
+        (_pt)->lc = __LINE__;     \
+        case __LINE__:            \
+            if (!(_cond)) {       \
+                return true;      \
+            }                     \
+    } while (0)
+
+#define PT_WAIT_WHILE(_pt, _cond) PT_WAIT_UNTIL(_pt, !(_cond))
+
+#define PT_SLEEP_US(_pt, _us)                            \
+    do {                                                 \
+        (_pt)->wake = time_us_64() + (_us);              \
+        PT_WAIT_UNTIL(_pt, time_us_64() >= (_pt)->wake); \
+    } while (0)
+
+/* Runs a child thread to completion */
+#define PT_SPAWN(_pt, _child, _thread) \
+    do {                               \
+        PT_INIT(_child);               \
+        PT_WAIT_WHILE(_pt, _thread);   \
+    } while (0)
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Multi-resolution rolling aggregates of a sampled value
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "rollup.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pico/stdlib.h"
+
+#define US_PER_SEC (1000000ull)
+
+static const struct {
+    uint64_t period_us;
+    size_t size;
+} levels[ROLLUP_NUM_LEVELS] = {
+    [ROLLUP_SECONDS] = {US_PER_SEC, 60},
+    [ROLLUP_MINUTES] = {60 * US_PER_SEC, 60},
+    [ROLLUP_HOURS] = {60 * 60 * US_PER_SEC, 24},
+};
+
+struct level {
+    /* Bucket being accumulated, and the time it closes */
+    struct rollup_bucket current;
+    uint64_t current_end;
+
+    /* Closed buckets, oldest first starting at head */
+    struct rollup_bucket* ring;
+    size_t head;
+    size_t count;
+};
+
+struct rollup {
+    struct level levels[ROLLUP_NUM_LEVELS];
+};
+
+static void merge(struct rollup_bucket* dest, struct rollup_bucket const* src) {
+    if (!dest->count) {
+        dest->min = src->min;
+        dest->max = src->max;
+    } else {
+        dest->min = MIN(dest->min, src->min);
+        dest->max = MAX(dest->max, src->max);
+    }
+    dest->count += src->count;
+    dest->sum += src->sum;
+}
+
+static void start_bucket(struct level* l, size_t n, uint32_t index) {
+    l->current.index = index;
+    l->current.count = 0;
+    l->current.sum = 0;
+    l->current_end = (index + 1) * levels[n].period_us;
+}
+
+/*
+ * Moves the current bucket of a level into its ring, and folds it into the
+ * next coarser level. Buckets are numbered by period, so periods without any
+ * samples are simply missing and no work is needed to skip them
+ */
+static void close_bucket(struct rollup* r, size_t n) {
+    struct level* l = &r->levels[n];
+
+    if (l->count == levels[n].size) {
+        l->ring[l->head] = l->current;
+        l->head = (l->head + 1) % levels[n].size;
+    } else {
+        l->ring[(l->head + l->count) % levels[n].size] = l->current;
+        l->count++;
+    }
+
+    if (n + 1 < ROLLUP_NUM_LEVELS) {
+        struct level* next = &r->levels[n + 1];
+        uint32_t index = (uint64_t)l->current.index * levels[n].period_us /
+                         levels[n + 1].period_us;
+
+        if (next->current.count && next->current.index != index) {
+            close_bucket(r, n + 1);
+        }
+        if (!next->current.count) {
+            start_bucket(next, n + 1, index);
+        }
+        merge(&next->current, &l->current);
+    }
+
+    l->current.count = 0;
+}
+
+struct rollup* rollup_create(void) {
+    struct rollup* r = calloc(1, sizeof(*r));
+
+    for (size_t n = 0; n < ROLLUP_NUM_LEVELS; n++) {
+        r->levels[n].ring =
+            calloc(levels[n].size, sizeof(struct rollup_bucket));
+    }
+
+    return r;
+}
+
+void rollup_free(struct rollup* r) {
+    for (size_t n = 0; n < ROLLUP_NUM_LEVELS; n++) {
+        free(r->levels[n].ring);
+    }
+    free(r);
+}
+
+void rollup_add(struct rollup* r, uint64_t now_us, int32_t value) {
+    struct level* l = &r->levels[ROLLUP_SECONDS];
+
+    if (l->current.count && now_us >= l->current_end) {
+        close_bucket(r, ROLLUP_SECONDS);
+    }
+
+    if (!l->current.count) {
+        start_bucket(l, ROLLUP_SECONDS, now_us / US_PER_SEC);
+        l->current.min = value;
+        l->current.max = value;
+    } else {
+        l->current.min = MIN(l->current.min, value);
+        l->current.max = MAX(l->current.max, value);
+    }
+    l->current.count++;
+    l->current.sum += value;
+}
+
+size_t rollup_count(struct rollup const* r, enum rollup_level level) {
+    return r->levels[level].count;
+}
+
+bool rollup_get(struct rollup const* r, enum rollup_level level, size_t n,
+                struct rollup_bucket* bucket) {
+    struct level const* l = &r->levels[level];
+
+    if (n >= l->count) {
+        return false;
+    }
+    *bucket = l->ring[(l->head + n) % levels[level].size];
+    return true;
+}
+
+bool rollup_get_current(struct rollup const* r, enum rollup_level level,
+                        struct rollup_bucket* bucket) {
+    struct level const* l = &r->levels[level];
+
+    if (!l->current.count) {
+        return false;
+    }
+    *bucket = l->current;
+    return true;
+}
@@ -0,0 +1,42 @@
+/*
+ * Multi-resolution rolling aggregates of a sampled value
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum rollup_level {
+    ROLLUP_SECONDS = 0, /* Last 60 seconds */
+    ROLLUP_MINUTES = 1, /* Last 60 minutes */
+    ROLLUP_HOURS = 2,   /* Last 24 hours */
+    ROLLUP_NUM_LEVELS,
+};
+
+struct rollup_bucket {
+    /* Number of the period since boot, e.g. the minute for ROLLUP_MINUTES */
+    uint32_t index;
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+};
+
+struct rollup;
+
+struct rollup* rollup_create(void);
+void rollup_free(struct rollup* r);
+void rollup_add(struct rollup* r, uint64_t now_us, int32_t value);
+size_t rollup_count(struct rollup const* r, enum rollup_level level);
+bool rollup_get(struct rollup const* r, enum rollup_level level, size_t n,
+                struct rollup_bucket* bucket);
+bool rollup_get_current(struct rollup const* r, enum rollup_level level,
+                        struct rollup_bucket* bucket);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Oscilloscope timing markers for Pico Pi
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _SCOPE_H_
+#define _SCOPE_H_
+
+/*
+ * Each marked region drives a spare GPIO high on entry and low on exit. The
+ * edges are a single write to the SIO set/clear registers, so the probe effect
+ * is one store per edge. When NUTATOR_SCOPE is not defined the markers compile
+ * to nothing.
+ *
+ * Pins default to the spare GPIOs on the control board and can be overridden
+ * from the build (see CMakeLists.txt)
+ */
+#ifdef NUTATOR_SCOPE
+
+#include "hardware/gpio.h"
+#include "hardware/structs/sio.h"
+
+#ifndef SCOPE_PIN_STEP
+#define SCOPE_PIN_STEP (16)
+#endif
+
+#ifndef SCOPE_PIN_UPDATE
+#define SCOPE_PIN_UPDATE (17)
+#endif
+
+#ifndef SCOPE_PIN_DISPLAY
+#define SCOPE_PIN_DISPLAY (18)
+#endif
+
+#ifndef SCOPE_PIN_FLASH
+#define SCOPE_PIN_FLASH (19)
+#endif
+
+#ifndef SCOPE_PIN_BUTTON
+#define SCOPE_PIN_BUTTON (20)
+#endif
+
+#define SCOPE_PIN_MASK                                           \
+    ((1ul << SCOPE_PIN_STEP) | (1ul << SCOPE_PIN_UPDATE) |       \
+     (1ul << SCOPE_PIN_DISPLAY) | (1ul << SCOPE_PIN_FLASH) |     \
+     (1ul << SCOPE_PIN_BUTTON))
+
+#define SCOPE_BEGIN(_region) (sio_hw->gpio_set = 1ul << SCOPE_PIN_##_region)
+#define SCOPE_END(_region) (sio_hw->gpio_clr = 1ul << SCOPE_PIN_##_region)
+
+static inline void scope_init(void) {
+    gpio_init_mask(SCOPE_PIN_MASK);
+    gpio_clr_mask(SCOPE_PIN_MASK);
+    gpio_set_dir_out_masked(SCOPE_PIN_MASK);
+}
+
+#else
+
+#define SCOPE_BEGIN(_region) ((void)0)
+#define SCOPE_END(_region) ((void)0)
+
+static inline void scope_init(void) {}
+
+#endif
+
+#endif
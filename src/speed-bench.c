@@ -0,0 +1,158 @@
+/*
+ * Step timing benchmark across the speed range
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "speed-bench.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pico/stdlib.h"
+#include "pt.h"
+
+/*
+ * Runs from the main loop, so the step timing measured includes everything
+ * else the main loop does. For each speed it reports the speed actually
+ * achieved, how late the steps were taken, and the longest gap between main
+ * loop iterations
+ */
+
+/* Time to run at each speed before measuring */
+#define SETTLE_US (500000)
+
+/* Steps later than this percentage of the step interval count as late */
+#define LATE_PERCENT (25)
+
+struct speed_bench {
+    struct stepper* motor;
+    unsigned int positions_per_rev;
+    struct pt pt;
+    bool running;
+
+    unsigned int step_rpm;
+    unsigned int max_rpm;
+    uint32_t hold_us;
+    unsigned int rpm;
+
+    uint64_t start;
+    uint64_t last_update;
+    uint64_t start_count;
+    uint64_t last_count;
+    uint64_t samples;
+    uint64_t late_sum;
+    uint32_t late_max;
+    uint64_t late_steps;
+    uint64_t loop_max;
+};
+
+static void sample(struct speed_bench* b, uint64_t now) {
+    uint64_t count = stepper_step_count(b->motor);
+
+    b->loop_max = MAX(b->loop_max, now - b->last_update);
+    b->last_update = now;
+
+    if (count == b->last_count) {
+        return;
+    }
+    b->last_count = count;
+
+    uint32_t lateness = stepper_get_lateness_us(b->motor);
+    b->samples++;
+    b->late_sum += lateness;
+    b->late_max = MAX(b->late_max, lateness);
+    if (lateness * 100ull >
+        (uint64_t)stepper_get_step_interval_us(b->motor) * LATE_PERCENT) {
+        b->late_steps++;
+    }
+}
+
+static void report(struct speed_bench* b, uint64_t now) {
+    uint64_t positions = b->last_count - b->start_count;
+    uint64_t mrpm =
+        positions * 60000000000ull / ((now - b->start) * b->positions_per_rev);
+
+    printf("%u,%" PRIu64 ".%03" PRIu64 ",%u,%" PRIu32 ",%" PRIu64
+           ",%" PRIu64 ",%" PRIu32 ",%" PRIu64 ",%" PRIu64 "\n",
+           b->rpm, mrpm / 1000, mrpm % 1000,
+           stepper_get_drive_percent(b->motor),
+           stepper_get_step_interval_us(b->motor), positions,
+           b->samples ? b->late_sum / b->samples : 0, b->late_max,
+           b->samples ? b->late_steps * 100 / b->samples : 0, b->loop_max);
+}
+
+static bool bench(struct speed_bench* b) {
+    uint64_t now = time_us_64();
+
+    PT_BEGIN(&b->pt);
+    printf(
+        "rpm,actual_rpm,drive,interval_us,positions,lateness_mean_us,"
+        "lateness_max_us,late_percent,loop_max_us\n");
+
+    for (b->rpm = b->step_rpm; b->rpm <= b->max_rpm; b->rpm += b->step_rpm) {
+        stepper_set_rpm(b->motor, b->rpm);
+        PT_WAIT_UNTIL(&b->pt, stepper_get_actual_rpm(b->motor) == b->rpm);
+
+        b->start = now;
+        PT_WAIT_UNTIL(&b->pt, now - b->start >= SETTLE_US);
+
+        b->start = now;
+        b->last_update = now;
+        b->start_count = stepper_step_count(b->motor);
+        b->last_count = b->start_count;
+        b->samples = 0;
+        b->late_sum = 0;
+        b->late_max = 0;
+        b->late_steps = 0;
+        b->loop_max = 0;
+
+        while (now - b->start < b->hold_us) {
+            sample(b, now);
+            PT_YIELD(&b->pt);
+        }
+        report(b, now);
+    }
+
+    stepper_set_rpm(b->motor, 0);
+    PT_END(&b->pt);
+}
+
+struct speed_bench* speed_bench_create(struct stepper* motor,
+                                       unsigned int positions_per_rev) {
+    struct speed_bench* b = calloc(1, sizeof(*b));
+
+    b->motor = motor;
+    b->positions_per_rev = positions_per_rev;
+
+    return b;
+}
+
+void speed_bench_free(struct speed_bench* b) { free(b); }
+
+void speed_bench_start(struct speed_bench* b, unsigned int step_rpm,
+                       unsigned int max_rpm, uint32_t hold_us) {
+    b->step_rpm = MAX(step_rpm, 1);
+    b->max_rpm = max_rpm;
+    b->hold_us = hold_us;
+    b->running = true;
+    PT_INIT(&b->pt);
+}
+
+void speed_bench_stop(struct speed_bench* b) {
+    if (b->running) {
+        stepper_set_rpm(b->motor, 0);
+        b->running = false;
+    }
+}
+
+bool speed_bench_update(struct speed_bench* b) {
+    if (b->running) {
+        b->running = bench(b);
+    }
+    return b->running;
+}
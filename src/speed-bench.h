@@ -0,0 +1,32 @@
+/*
+ * Step timing benchmark across the speed range
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _SPEED_BENCH_H_
+#define _SPEED_BENCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stepper-motor.h"
+
+struct speed_bench;
+
+/* positions_per_rev is the number of half steps (or steps) per revolution */
+struct speed_bench* speed_bench_create(struct stepper* motor,
+                                       unsigned int positions_per_rev);
+void speed_bench_free(struct speed_bench* b);
+/*
+ * Runs the motor at each speed from step_rpm up to max_rpm in turn, measuring
+ * for hold_us at each. The motor must be stopped
+ */
+void speed_bench_start(struct speed_bench* b, unsigned int step_rpm,
+                       unsigned int max_rpm, uint32_t hold_us);
+void speed_bench_stop(struct speed_bench* b);
+/* Returns true while the benchmark is running */
+bool speed_bench_update(struct speed_bench* b);
+
+#endif
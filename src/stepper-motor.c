@@ -10,58 +10,248 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pwm.h"
 #include "pico/stdlib.h"
+#include "scope.h"
 
 #define US_PER_SEC (1000000ull)
 #define US_PER_MIN (60 * US_PER_SEC)
 
-#define MIN_RPM (1ull)
+#define PPB (1000000000ll)
+
+/* Fractional bits of the step interval at the target speed */
+#define STEP_FRAC_BITS (16)
+
+/* Fractional bits of the speed while accelerating */
+#define RPM_FRAC_BITS (16)
+
+/* Must be a power of 2 */
+#define EVENT_QUEUE_SIZE (16)
+
+struct stepper_pin {
+    unsigned int pin;
+    bool is_pwm;
+
+    /* PWM pins only */
+    unsigned int slice;
+    unsigned int chan;
+    uint16_t level;
+    uint32_t top;
+    uint32_t off;
+    uint32_t current;
+    int dma_chan;
+};
 
 struct stepper {
     unsigned int steps_per_rev;
     unsigned int max_rpm;
     enum stepper_mode mode;
-    unsigned int mask;
-    unsigned int half_mask;
+    bool braked;
+    size_t phase;
+    size_t num_positions;
     unsigned int target_rpm;
     unsigned int accel_rpm_per_sec;
+    unsigned int min_rpm;
     int enable_pin;
     size_t num_pins;
-    struct {
-        unsigned int pin;
-        bool is_pwm;
-    }* pins;
+    struct stepper_pin* pins;
+    unsigned int ramp_periods;
+    uint32_t pwm_period_ns;
+    /* Ramp periods used at the current speed, and the interval they all fit */
+    unsigned int ramp_len;
+    uint64_t ramp_full_us;
+    int8_t* trim;
+    size_t num_trim;
+    /*
+     * Per position, the value written to each pin; the compare register for
+     * PWM pins, or 0/1 for GPIO pins
+     */
+    uint32_t* drive;
+    /*
+     * Per position, direction and stride, the DMA tables to reach the drive
+     * values
+     */
+    uint32_t* ramps;
+
+    struct stepper_speed_band bands[STEPPER_MAX_SPEED_BANDS];
+    size_t num_bands;
+    size_t band;
+    /* Positions moved per step */
+    unsigned int stride;
+    unsigned int drive_percent;
+
     uint64_t last_step;
     uint64_t us_per_step_target;
+    uint32_t us_per_step_frac;
+    uint32_t frac_acc;
+    int32_t clock_trim_ppb;
     uint64_t us_per_step;
-    uint64_t us_accel;
-    uint64_t max_us_per_step;
-    uint64_t last_accel_step;
+    /* Current speed, in RPM with RPM_FRAC_BITS fractional bits */
+    uint64_t speed;
+    uint64_t last_accel;
     uint64_t step_count;
+    uint32_t lateness_us;
+
+    unsigned int ramp_event_percent;
+    uint64_t ramp_speed_low;
+    uint64_t ramp_speed_high;
+    bool position_event;
+    uint64_t position_event_step;
+    bool late;
+    struct stepper_event events[EVENT_QUEUE_SIZE];
+    unsigned int event_head;
+    unsigned int event_tail;
 };
 
-static uint64_t rpm_to_step_us(struct stepper const* s, unsigned int rpm) {
-    return US_PER_MIN / ((uint64_t)rpm * s->steps_per_rev);
+static size_t find_band(struct stepper const* s, unsigned int rpm) {
+    size_t band = 0;
+    while (band + 1 < s->num_bands && rpm >= s->bands[band + 1].min_rpm) {
+        band++;
+    }
+    return band;
+}
+
+static unsigned int band_stride(struct stepper const* s, size_t band) {
+    return s->mode == STEPPER_MODE_HALF_STEP && s->bands[band].full_step ? 2
+                                                                         : 1;
+}
+
+/*
+ * Sets the step interval for the target RPM. The fractional microseconds are
+ * kept so that the average interval at the target speed is exact, and it is
+ * scaled by the clock trim so it is in units of the (not quite 1 MHz) timer
+ */
+static void set_target_interval(struct stepper* s) {
+    if (!s->target_rpm) {
+        s->us_per_step_target = 0;
+        s->us_per_step_frac = 0;
+        return;
+    }
+
+    int64_t interval = (US_PER_MIN << STEP_FRAC_BITS) *
+                       band_stride(s, find_band(s, s->target_rpm)) /
+                       ((uint64_t)s->target_rpm * s->steps_per_rev);
+    interval += interval * s->clock_trim_ppb / PPB;
+
+    s->us_per_step_target = interval >> STEP_FRAC_BITS;
+    s->us_per_step_frac = interval & ((1 << STEP_FRAC_BITS) - 1);
+}
+
+static void push_event(struct stepper* s, enum stepper_event_type type,
+                       unsigned int value) {
+    /* If the application isn't draining the queue, newer events are dropped */
+    if (s->event_head - s->event_tail >= EVENT_QUEUE_SIZE) {
+        return;
+    }
+
+    struct stepper_event* e =
+        &s->events[s->event_head & (EVENT_QUEUE_SIZE - 1)];
+    e->type = type;
+    e->value = value;
+    e->step_count = s->step_count;
+    s->event_head++;
+}
+
+/*
+ * Raises a ramp percentage event when the speed leaves the band for the last
+ * reported percentage. The band limits are computed only when an event is
+ * raised, so the common case is two compares
+ */
+static void check_ramp_percent(struct stepper* s) {
+    if (!s->ramp_event_percent || !s->target_rpm || !s->speed) {
+        return;
+    }
+
+    if (s->speed >= s->ramp_speed_low && s->speed < s->ramp_speed_high) {
+        return;
+    }
+
+    uint64_t target = (uint64_t)s->target_rpm << RPM_FRAC_BITS;
+    uint64_t percent = 100 * s->speed / target;
+    percent -= percent % s->ramp_event_percent;
+
+    s->ramp_speed_low = target * percent / 100;
+    s->ramp_speed_high = target * (percent + s->ramp_event_percent) / 100;
+
+    push_event(s, STEPPER_EVENT_RAMP_PERCENT, percent);
+}
+
+static void update_speed_events(struct stepper* s, uint64_t old_speed) {
+    if (s->speed == old_speed) {
+        return;
+    }
+
+    if (!s->speed) {
+        push_event(s, STEPPER_EVENT_STOPPED, 0);
+    } else if (s->speed == (uint64_t)s->target_rpm << RPM_FRAC_BITS) {
+        push_event(s, STEPPER_EVENT_TARGET_REACHED, 0);
+    } else {
+        check_ramp_percent(s);
+    }
+}
+
+static uint32_t* ramp_table(struct stepper const* s, size_t phase,
+                            bool forward, unsigned int stride, size_t pin) {
+    return &s->ramps[(((phase * 2 + forward) * 2 + stride - 1) * s->num_pins +
+                      pin) *
+                     s->ramp_periods];
 }
 
-static void update(struct stepper const* s) {
+static void stop_ramp(struct stepper_pin const* p) {
+    if (p->dma_chan >= 0 && dma_channel_is_busy(p->dma_chan)) {
+        dma_channel_abort(p->dma_chan);
+    }
+}
+
+/*
+ * Sets the pin outputs for the current position. A direction of 0 jumps
+ * straight to the drive values; otherwise, if enabled, PWM pins whose value
+ * changes have a DMA walk the compare level to it over a few PWM periods. The
+ * magnitude of the direction is the number of positions moved.
+ *
+ * A shortened ramp uses the end of the table, so it starts with a jump part
+ * of the way to the new level
+ */
+static void update(struct stepper* s, int dir) {
+    SCOPE_BEGIN(UPDATE);
     uint32_t mask = 0;
     uint32_t value = 0;
+    uint32_t const* drive = &s->drive[s->phase * s->num_pins];
     for (size_t i = 0; i < s->num_pins; i++) {
-        mask |= 1 << s->pins[i].pin;
+        struct stepper_pin* p = &s->pins[i];
+        uint32_t d = s->braked ? p->off : drive[i];
 
-        if (((s->mask | s->half_mask) >> i) & 0x1) {
-            if (s->pins[i].is_pwm) {
-                gpio_set_function(s->pins[i].pin, GPIO_FUNC_PWM);
-            } else {
-                value |= 1 << s->pins[i].pin;
+        if (!p->is_pwm) {
+            mask |= 1 << p->pin;
+            if (d) {
+                value |= 1 << p->pin;
             }
-        } else if (s->pins[i].is_pwm) {
-            gpio_set_function(s->pins[i].pin, GPIO_FUNC_SIO);
+            continue;
         }
+
+        if (d == p->current) {
+            continue;
+        }
+
+        stop_ramp(p);
+        if (s->ramp_len && dir && !s->braked) {
+            dma_channel_set_read_addr(
+                p->dma_chan,
+                ramp_table(s, s->phase, dir > 0, abs(dir), i) +
+                    s->ramp_periods - s->ramp_len,
+                false);
+            dma_channel_set_trans_count(p->dma_chan, s->ramp_len, true);
+        } else {
+            pwm_hw->slice[p->slice].cc = d;
+        }
+        p->current = d;
     }
     gpio_put_masked(mask, value);
+    SCOPE_END(UPDATE);
 }
 
 static uint32_t step_mask(uint32_t mask, bool forward, size_t num_pins) {
@@ -81,24 +271,234 @@ static uint32_t step_mask(uint32_t mask, bool forward, size_t num_pins) {
     return mask;
 }
 
+/*
+ * Builds the drive and ramp tables for each position in an electrical cycle.
+ * This is where the trim is applied, so stepping is only a table lookup.
+ *
+ * A positive trim for a position pulls the rotor toward the next position by
+ * partially driving the coil that turns on at the next position, or by
+ * reducing the coil that turns off. A negative trim does the same toward the
+ * previous position. GPIO (non-PWM) pins can only be on or off, so they are
+ * driven if the trimmed drive is above 50%.
+ *
+ * The drive level of the current speed band scales the PWM levels, so this
+ * is rebuilt when it changes
+ */
+static void build_tables(struct stepper* s) {
+    if (!s->num_pins) {
+        return;
+    }
+
+    for (size_t i = 0; i < s->num_pins; i++) {
+        stop_ramp(&s->pins[i]);
+    }
+
+    s->num_positions = s->num_pins;
+    if (s->mode == STEPPER_MODE_HALF_STEP) {
+        s->num_positions *= 2;
+    }
+    s->phase %= s->num_positions;
+
+    /*
+     * The coils that are on at each position, starting from the hold
+     * position. For half step, the two masks advance alternately. Which one
+     * moves first doesn't matter since they start on the same pin
+     */
+    uint32_t pattern[s->num_positions];
+    uint32_t mask = s->mode == STEPPER_MODE_DUAL_PHASE ? 0x3 : 0x1;
+    uint32_t half_mask = s->mode == STEPPER_MODE_HALF_STEP ? 0x1 : 0x0;
+    for (size_t n = 0; n < s->num_positions; n++) {
+        pattern[n] = mask | half_mask;
+        if (s->mode != STEPPER_MODE_HALF_STEP || (n & 1)) {
+            mask = step_mask(mask, true, s->num_pins);
+        } else {
+            half_mask = step_mask(half_mask, true, s->num_pins);
+        }
+    }
+
+    uint16_t levels[s->num_positions][s->num_pins];
+    s->drive = realloc(s->drive, sizeof(*s->drive) * s->num_positions *
+                                     s->num_pins);
+    for (size_t n = 0; n < s->num_positions; n++) {
+        int trim = n < s->num_trim ? s->trim[n] : 0;
+        uint32_t toward =
+            pattern[(n + (trim > 0 ? 1 : s->num_positions - 1)) %
+                    s->num_positions];
+
+        for (size_t i = 0; i < s->num_pins; i++) {
+            struct stepper_pin const* p = &s->pins[i];
+            unsigned int percent = (pattern[n] >> i) & 0x1 ? 100 : 0;
+
+            if (((toward & ~pattern[n]) >> i) & 0x1) {
+                percent = abs(trim);
+            } else if (((pattern[n] & ~toward) >> i) & 0x1) {
+                percent = 100 - abs(trim);
+            }
+
+            if (p->is_pwm) {
+                unsigned int shift = p->chan == PWM_CHAN_B ? 16 : 0;
+                levels[n][i] = MIN((uint64_t)p->level * percent *
+                                       s->drive_percent / 10000,
+                                   p->top + 1);
+                s->drive[n * s->num_pins + i] =
+                    p->off | (levels[n][i] << shift);
+            } else {
+                s->drive[n * s->num_pins + i] = percent > 50;
+            }
+        }
+    }
+
+    if (!s->ramp_periods) {
+        return;
+    }
+
+    s->ramps = realloc(s->ramps, sizeof(*s->ramps) * s->num_positions * 2 *
+                                     2 * s->num_pins * s->ramp_periods);
+    for (size_t n = 0; n < s->num_positions; n++) {
+        for (int forward = 0; forward < 2; forward++) {
+            for (unsigned int stride = 1; stride <= 2; stride++) {
+                size_t from =
+                    (n + (forward ? s->num_positions - stride : stride)) %
+                    s->num_positions;
+
+                for (size_t i = 0; i < s->num_pins; i++) {
+                    struct stepper_pin const* p = &s->pins[i];
+                    unsigned int shift = p->chan == PWM_CHAN_B ? 16 : 0;
+                    uint32_t* ramp = ramp_table(s, n, forward, stride, i);
+                    int32_t a = levels[from][i];
+                    int32_t b = levels[n][i];
+
+                    for (unsigned int k = 0; k < s->ramp_periods; k++) {
+                        int32_t level = a + (b - a) * (int32_t)(k + 1) /
+                                                (int32_t)s->ramp_periods;
+                        ramp[k] = p->off | ((uint32_t)level << shift);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void set_band(struct stepper* s, size_t band) {
+    unsigned int drive =
+        s->bands[band].drive_percent ? s->bands[band].drive_percent : 100;
+
+    s->band = band;
+    s->stride = band_stride(s, band);
+    if (drive != s->drive_percent) {
+        s->drive_percent = drive;
+        build_tables(s);
+        update(s, 0);
+    }
+}
+
+/*
+ * Applies the speed band, step interval and ramp length for a new speed.
+ * Stopping goes back to the lowest band, so the motor isn't held at a high
+ * speed drive level
+ */
+static void set_speed(struct stepper* s, uint64_t speed) {
+    size_t band = find_band(s, speed >> RPM_FRAC_BITS);
+    if (band != s->band) {
+        set_band(s, band);
+    }
+
+    s->speed = speed;
+    if (!speed) {
+        s->us_per_step = 0;
+        return;
+    }
+
+    if (speed == (uint64_t)s->target_rpm << RPM_FRAC_BITS) {
+        s->us_per_step = s->us_per_step_target;
+    } else {
+        s->us_per_step = (US_PER_MIN << RPM_FRAC_BITS) * s->stride /
+                         (speed * s->steps_per_rev);
+    }
+
+    if (s->us_per_step >= s->ramp_full_us || !s->pwm_period_ns) {
+        s->ramp_len = s->ramp_periods;
+    } else {
+        s->ramp_len = s->us_per_step * 1000 / 2 / s->pwm_period_ns;
+    }
+}
+
+/*
+ * Moves the speed toward the target at the acceleration of the current speed
+ * band. The motor starts at, and stops from, the minimum speed. Time that
+ * isn't enough for any change carries over to the next call
+ */
+static void accelerate(struct stepper* s, uint64_t now) {
+    uint64_t target = (uint64_t)s->target_rpm << RPM_FRAC_BITS;
+    uint64_t min_speed = (uint64_t)MAX(s->min_rpm, 1) << RPM_FRAC_BITS;
+
+    if (s->speed == target) {
+        s->last_accel = now;
+        return;
+    }
+
+    if (!s->speed) {
+        set_speed(s, MIN(min_speed, target));
+        s->last_accel = now;
+        return;
+    }
+
+    unsigned int accel = s->bands[s->band].accel_rpm_per_sec
+                             ? s->bands[s->band].accel_rpm_per_sec
+                             : s->accel_rpm_per_sec;
+    uint64_t delta =
+        ((now - s->last_accel) * accel << RPM_FRAC_BITS) / US_PER_SEC;
+    if (!delta) {
+        return;
+    }
+    s->last_accel = now;
+
+    if (!target) {
+        set_speed(s, s->speed > min_speed + delta ? s->speed - delta : 0);
+    } else if (s->speed < target) {
+        set_speed(s, MIN(s->speed + delta, target));
+    } else {
+        set_speed(s, s->speed > target + delta ? s->speed - delta : target);
+    }
+}
+
 static void step(struct stepper* s, bool forward) {
-    if (!s->mask) {
+    if (s->braked) {
         stepper_hold(s);
         return;
     }
 
+    SCOPE_BEGIN(STEP);
+
     /*
-     * For half step, move the main mask on odd steps, and the half mask on
-     * even steps
+     * Full steps are between the two coil (odd) positions, so switching to
+     * full steps starts with a half step if needed
      */
-    if (s->mode != STEPPER_MODE_HALF_STEP || (s->step_count & 1)) {
-        s->mask = step_mask(s->mask, forward, s->num_pins);
+    unsigned int stride = s->stride;
+    if (stride == 2 && !(s->phase & 1)) {
+        stride = 1;
+    }
+
+    if (forward) {
+        s->phase += stride;
+        if (s->phase >= s->num_positions) {
+            s->phase -= s->num_positions;
+        }
     } else {
-        s->half_mask = step_mask(s->half_mask, forward, s->num_pins);
+        if (s->phase < stride) {
+            s->phase += s->num_positions;
+        }
+        s->phase -= stride;
     }
 
-    s->step_count++;
-    update(s);
+    s->step_count += stride;
+    update(s, forward ? (int)stride : -(int)stride);
+
+    if (s->position_event && s->step_count >= s->position_event_step) {
+        s->position_event = false;
+        push_event(s, STEPPER_EVENT_POSITION_REACHED, 0);
+    }
+    SCOPE_END(STEP);
 }
 
 struct stepper* stepper_create(unsigned int steps_per_rev, unsigned int max_rpm,
@@ -110,6 +510,10 @@ struct stepper* stepper_create(unsigned int steps_per_rev, unsigned int max_rpm,
     }
     s->max_rpm = max_rpm;
     s->mode = mode;
+    s->braked = true;
+    s->num_bands = 1;
+    s->stride = 1;
+    s->drive_percent = 100;
     s->enable_pin = enable_pin;
     if (enable_pin >= 0) {
         gpio_init(enable_pin);
@@ -121,116 +525,203 @@ struct stepper* stepper_create(unsigned int steps_per_rev, unsigned int max_rpm,
 
 void stepper_free(struct stepper* s) {
     for (size_t i = 0; i < s->num_pins; i++) {
+        if (s->pins[i].dma_chan >= 0) {
+            dma_channel_abort(s->pins[i].dma_chan);
+            dma_channel_unclaim(s->pins[i].dma_chan);
+        }
         gpio_deinit(s->pins[i].pin);
     }
     if (s->enable_pin >= 0) {
         gpio_deinit(s->enable_pin);
     }
     free(s->pins);
+    free(s->trim);
+    free(s->drive);
+    free(s->ramps);
     free(s);
 }
 
 void stepper_add_pin(struct stepper* s, unsigned int pin, bool is_pwm) {
     s->pins = realloc(s->pins, sizeof(*s->pins) * (s->num_pins + 1));
-    s->pins[s->num_pins].pin = pin;
-    s->pins[s->num_pins].is_pwm = is_pwm;
+    memset(&s->pins[s->num_pins], 0, sizeof(*s->pins));
+    struct stepper_pin* p = &s->pins[s->num_pins];
+    p->pin = pin;
+    p->is_pwm = is_pwm;
+    p->dma_chan = -1;
     s->num_pins++;
 
     gpio_init(pin);
     gpio_set_dir(pin, GPIO_OUT);
     gpio_put(pin, 0);
+
+    if (is_pwm) {
+        /*
+         * The level the slice was configured with is the full drive level.
+         * The pin stays connected to the PWM and is switched off by a compare
+         * level of 0. Only this pin's channel is ever written; the other
+         * channel of the slice is preserved in every value written
+         */
+        p->slice = pwm_gpio_to_slice_num(pin);
+        p->chan = pwm_gpio_to_channel(pin);
+
+        unsigned int shift = p->chan == PWM_CHAN_B ? 16 : 0;
+        uint32_t cc = pwm_hw->slice[p->slice].cc;
+        p->level = (cc >> shift) & 0xFFFF;
+        p->top = pwm_hw->slice[p->slice].top;
+        p->off = cc & ~(0xFFFFu << shift);
+        p->current = p->off;
+        pwm_hw->slice[p->slice].cc = p->off;
+        gpio_set_function(pin, GPIO_FUNC_PWM);
+
+        /* The divider is 8.4 fixed point */
+        s->pwm_period_ns = (uint64_t)(p->top + 1) *
+                           pwm_hw->slice[p->slice].div * 1000000000ull / 16 /
+                           clock_get_hz(clk_sys);
+        s->ramp_full_us =
+            (uint64_t)s->ramp_periods * s->pwm_period_ns * 2 / 1000;
+    }
+
+    build_tables(s);
 }
 
 void stepper_set_accel(struct stepper* s, unsigned int rpm_per_sec,
                        unsigned int min_rpm) {
-    if (rpm_per_sec == 0) {
-        s->us_accel = 0;
-    } else {
-        s->us_accel = rpm_to_step_us(s, rpm_per_sec * 60);
-        s->max_us_per_step = rpm_to_step_us(s, min_rpm);
+    s->accel_rpm_per_sec = rpm_per_sec;
+    s->min_rpm = min_rpm;
+}
+
+void stepper_set_pwm_ramp(struct stepper* s, unsigned int periods) {
+    s->ramp_periods = MIN(periods, STEPPER_MAX_RAMP_PERIODS);
+    s->ramp_len = s->ramp_periods;
+    s->ramp_full_us = (uint64_t)s->ramp_periods * s->pwm_period_ns * 2 / 1000;
+    build_tables(s);
+
+    for (size_t i = 0; i < s->num_pins && s->ramp_periods; i++) {
+        struct stepper_pin* p = &s->pins[i];
+        if (!p->is_pwm) {
+            continue;
+        }
+
+        if (p->dma_chan < 0) {
+            p->dma_chan = dma_claim_unused_channel(true);
+        }
+
+        /*
+         * Each transfer is paced by the slice wrap, so the compare level
+         * changes once per PWM period
+         */
+        dma_channel_config c = dma_channel_get_default_config(p->dma_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pwm_get_dreq(p->slice));
+        dma_channel_configure(p->dma_chan, &c, &pwm_hw->slice[p->slice].cc,
+                              NULL, 0, false);
     }
+
+    update(s, 0);
 }
 
+void stepper_set_position_trim(struct stepper* s, int8_t const* trim,
+                               size_t count) {
+    s->trim = realloc(s->trim, sizeof(*s->trim) * count);
+    for (size_t n = 0; n < count; n++) {
+        s->trim[n] = MAX(MIN(trim[n], STEPPER_MAX_TRIM), -STEPPER_MAX_TRIM);
+    }
+    s->num_trim = count;
+    build_tables(s);
+    update(s, 0);
+}
+
+void stepper_set_speed_bands(struct stepper* s,
+                             struct stepper_speed_band const* bands,
+                             size_t count) {
+    count = MIN(count, STEPPER_MAX_SPEED_BANDS);
+    if (!count) {
+        static const struct stepper_speed_band default_band = {0};
+        bands = &default_band;
+        count = 1;
+    }
+
+    memcpy(s->bands, bands, sizeof(*bands) * count);
+    s->num_bands = count;
+
+    set_band(s, find_band(s, s->speed >> RPM_FRAC_BITS));
+    set_target_interval(s);
+    set_speed(s, s->speed);
+}
+
+unsigned int stepper_get_drive_percent(struct stepper const* s) {
+    return s->drive_percent;
+}
+
+size_t stepper_get_num_positions(struct stepper const* s) {
+    return s->num_positions;
+}
+
+size_t stepper_get_position(struct stepper const* s) { return s->phase; }
+
 void stepper_step(struct stepper* s, bool forward) {
     step(s, forward);
     s->last_step = time_us_64();
-    s->last_accel_step = s->last_step;
+    s->last_accel = s->last_step;
 }
 
 bool stepper_update(struct stepper* s) {
     uint64_t now = time_us_64();
+    uint64_t old_speed = s->speed;
 
-    if (s->us_accel) {
-        if (s->us_per_step_target == 0 &&
-            (s->us_per_step == s->max_us_per_step || s->us_per_step == 0)) {
-            s->us_per_step = 0;
-        } else if (s->us_per_step_target != 0 && s->us_per_step == 0) {
-            s->us_per_step = s->max_us_per_step;
-        } else {
-            if (now >= s->last_accel_step) {
-                int num_steps = (now - s->last_accel_step) / s->us_accel;
-                int64_t target = s->us_per_step_target ? s->us_per_step_target
-                                                       : s->max_us_per_step;
-
-                if (s->us_per_step < target) {
-                    s->us_per_step =
-                        MIN((int64_t)s->us_per_step + num_steps, target);
-                } else if (s->us_per_step > target) {
-                    s->us_per_step =
-                        MAX((int64_t)s->us_per_step - num_steps, target);
-                }
-
-                s->last_accel_step += s->us_accel * num_steps;
-            }
-        }
-    } else {
-        s->us_per_step = s->us_per_step_target;
+    if (s->accel_rpm_per_sec) {
+        accelerate(s, now);
+    } else if (s->speed != (uint64_t)s->target_rpm << RPM_FRAC_BITS) {
+        set_speed(s, (uint64_t)s->target_rpm << RPM_FRAC_BITS);
     }
 
+    update_speed_events(s, old_speed);
+
     if (!s->us_per_step) {
+        s->late = false;
         return false;
     }
 
     if (now >= s->last_step) {
         int num_steps = (now - s->last_step) / s->us_per_step;
         if (num_steps) {
+            s->lateness_us =
+                MIN(now - s->last_step - s->us_per_step, UINT32_MAX);
             step(s, true);
             s->last_step += s->us_per_step;
+            if (s->us_per_step == s->us_per_step_target) {
+                s->frac_acc += s->us_per_step_frac;
+                s->last_step += s->frac_acc >> STEP_FRAC_BITS;
+                s->frac_acc &= (1 << STEP_FRAC_BITS) - 1;
+            }
+            if (num_steps > 1 && s->bands[s->band].drop_missed) {
+                s->last_step = now;
+                s->frac_acc = 0;
+            }
         }
 
+        /* Only report the transition into being late to avoid a flood */
+        if (num_steps > 1 && !s->late) {
+            push_event(s, STEPPER_EVENT_FAULT, num_steps - 1);
+        }
+        s->late = num_steps > 1;
+
         return num_steps > 1;
     }
     return false;
 }
 
 void stepper_brake(struct stepper* s) {
-    s->mask = 0;
-    s->half_mask = 0;
-    update(s);
+    s->braked = true;
+    update(s, 0);
 }
 
 void stepper_hold(struct stepper* s) {
-    switch (s->mode) {
-        case STEPPER_MODE_WAVE:
-            s->mask = 0x1;
-            s->half_mask = 0x0;
-            break;
-
-        case STEPPER_MODE_DUAL_PHASE:
-            s->mask = 0x3;
-            s->half_mask = 0x0;
-            break;
-
-        case STEPPER_MODE_HALF_STEP:
-            /*
-             * Both masks must start on the same pin since it is random which
-             * one will advance first
-             */
-            s->mask = 0x1;
-            s->half_mask = 0x1;
-            break;
-    }
-    update(s);
+    s->braked = false;
+    s->phase = 0;
+    update(s, 0);
 }
 
 void stepper_enable(struct stepper* s, bool enable) {
@@ -247,22 +738,52 @@ void stepper_set_rpm(struct stepper* s, unsigned int rpm) {
     }
 
     s->target_rpm = rpm;
+    s->ramp_speed_low = 0;
+    s->ramp_speed_high = 0;
     s->last_step = time_us_64();
-    s->last_accel_step = time_us_64();
-    if (rpm) {
-        s->us_per_step_target = rpm_to_step_us(s, rpm);
-    } else {
-        s->us_per_step_target = 0;
-    }
+    s->last_accel = time_us_64();
+    set_target_interval(s);
+}
+
+void stepper_set_clock_trim(struct stepper* s, int32_t ppb) {
+    s->clock_trim_ppb = ppb;
+    set_target_interval(s);
+    set_speed(s, s->speed);
 }
 
 unsigned int stepper_get_rpm(struct stepper const* s) { return s->target_rpm; }
 
 unsigned int stepper_get_actual_rpm(struct stepper const* s) {
-    if (!s->us_per_step) {
-        return 0;
-    }
-    return US_PER_MIN / (s->us_per_step * s->steps_per_rev);
+    return s->speed >> RPM_FRAC_BITS;
 }
 
 uint64_t stepper_step_count(struct stepper const* s) { return s->step_count; }
+
+uint32_t stepper_get_lateness_us(struct stepper const* s) {
+    return s->lateness_us;
+}
+
+uint32_t stepper_get_step_interval_us(struct stepper const* s) {
+    return MIN(s->us_per_step, UINT32_MAX);
+}
+
+void stepper_set_ramp_event_percent(struct stepper* s, unsigned int percent) {
+    s->ramp_event_percent = percent;
+    s->ramp_speed_low = 0;
+    s->ramp_speed_high = 0;
+}
+
+void stepper_set_position_event(struct stepper* s, uint64_t step_count) {
+    s->position_event = true;
+    s->position_event_step = step_count;
+}
+
+bool stepper_get_event(struct stepper* s, struct stepper_event* event) {
+    if (s->event_tail == s->event_head) {
+        return false;
+    }
+
+    *event = s->events[s->event_tail & (EVENT_QUEUE_SIZE - 1)];
+    s->event_tail++;
+    return true;
+}
@@ -9,8 +9,21 @@
 #define _STEPPER_MOTOR_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Maximum number of PWM periods a soft phase transition can be spread over
+ */
+#define STEPPER_MAX_RAMP_PERIODS (16)
+
+/*
+ * Limit of the per-position trim, in percent of the drive level
+ */
+#define STEPPER_MAX_TRIM (50)
+
+#define STEPPER_MAX_SPEED_BANDS (4)
+
 struct stepper;
 
 enum stepper_mode {
@@ -19,20 +32,83 @@ enum stepper_mode {
     STEPPER_MODE_HALF_STEP = 2,
 };
 
+enum stepper_event_type {
+    STEPPER_EVENT_TARGET_REACHED = 0, /* Ramp finished at the target RPM */
+    STEPPER_EVENT_STOPPED = 1,        /* Ramp finished at 0 RPM */
+    STEPPER_EVENT_RAMP_PERCENT = 2,   /* Actual RPM crossed a percentage */
+    STEPPER_EVENT_POSITION_REACHED = 3,
+    STEPPER_EVENT_FAULT = 4, /* Step deadline missed */
+};
+
+/*
+ * Settings that depend on speed. A band applies from its min_rpm up to the
+ * next band's min_rpm; bands are in increasing order of min_rpm
+ */
+struct stepper_speed_band {
+    unsigned int min_rpm;
+    /*
+     * Half step motors only. Only the two coil positions are used, so each
+     * step moves two positions
+     */
+    bool full_step;
+    /* Percent of the configured PWM level, may be over 100. 0 is 100 */
+    unsigned int drive_percent;
+    /* 0 uses the acceleration from stepper_set_accel() */
+    unsigned int accel_rpm_per_sec;
+    /*
+     * Steps missed after a stall are dropped rather than caught up, which
+     * could lose sync at speed. Still reported as a fault
+     */
+    bool drop_missed;
+};
+
+struct stepper_event {
+    enum stepper_event_type type;
+    /*
+     * Percentage of the target RPM for STEPPER_EVENT_RAMP_PERCENT, or the
+     * number of missed steps for STEPPER_EVENT_FAULT
+     */
+    unsigned int value;
+    uint64_t step_count;
+};
+
 struct stepper* stepper_create(unsigned int steps_per_rev, unsigned int max_rpm,
                                enum stepper_mode mode, int enable_pin);
 
 void stepper_add_pin(struct stepper* s, unsigned int pin, bool is_pwm);
 void stepper_set_accel(struct stepper* s, unsigned int rpm_per_sec,
                        unsigned int min_rpm);
+/*
+ * Ramps are shortened as needed so they take at most half of the step
+ * interval
+ */
+void stepper_set_pwm_ramp(struct stepper* s, unsigned int periods);
+void stepper_set_speed_bands(struct stepper* s,
+                             struct stepper_speed_band const* bands,
+                             size_t count);
+/* Drive level of the current speed band, in percent of the PWM level */
+unsigned int stepper_get_drive_percent(struct stepper const* s);
+void stepper_set_position_trim(struct stepper* s, int8_t const* trim,
+                               size_t count);
+size_t stepper_get_num_positions(struct stepper const* s);
+size_t stepper_get_position(struct stepper const* s);
 void stepper_step(struct stepper* s, bool forward);
 bool stepper_update(struct stepper* s);
 void stepper_brake(struct stepper* s);
 void stepper_hold(struct stepper* s);
 void stepper_enable(struct stepper* s, bool enable);
 void stepper_set_rpm(struct stepper* s, unsigned int rpm);
+/* Error of the system timer, in parts per billion; positive if it runs fast */
+void stepper_set_clock_trim(struct stepper* s, int32_t ppb);
 unsigned int stepper_get_rpm(struct stepper const* s);
 unsigned int stepper_get_actual_rpm(struct stepper const* s);
 uint64_t stepper_step_count(struct stepper const* s);
+/* How long after its deadline the last step was taken */
+uint32_t stepper_get_lateness_us(struct stepper const* s);
+/* Interval between steps at the current speed; 0 when stopped */
+uint32_t stepper_get_step_interval_us(struct stepper const* s);
+void stepper_set_ramp_event_percent(struct stepper* s, unsigned int percent);
+void stepper_set_position_event(struct stepper* s, uint64_t step_count);
+bool stepper_get_event(struct stepper* s, struct stepper_event* event);
 
 #endif
@@ -0,0 +1,101 @@
+/*
+ * System timer error measurement against the USB start of frame clock
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#include "timebase.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hardware/structs/usb.h"
+#include "pico/stdlib.h"
+
+/*
+ * A USB host sends a start of frame every 1 ms, timed from its own (much more
+ * accurate) clock. Counting frames against the system timer over a long
+ * window gives the error of the crystal the timer runs from. A frame is
+ * noticed up to one main loop late, so the window is long enough (5 minutes)
+ * that this jitter is well under a part per million
+ */
+#define US_PER_FRAME (1000)
+#define WINDOW_FRAMES (300000)
+
+/*
+ * If no frame is seen for this long the host is gone (or suspended the bus),
+ * and the window starts over
+ */
+#define FRAME_TIMEOUT_US (10000)
+
+#define PPB (1000000000ll)
+
+/*
+ * The crystal is specified well within this. A larger error means a window
+ * was disturbed, and it is discarded
+ */
+#define MAX_ERROR_PPB (100000)
+
+struct timebase {
+    bool running;
+    uint32_t last_frame;
+    uint64_t last_frame_time;
+    uint64_t start_time;
+    uint32_t frames;
+};
+
+struct timebase* timebase_create(void) {
+    struct timebase* t = calloc(1, sizeof(*t));
+    return t;
+}
+
+void timebase_free(struct timebase* t) { free(t); }
+
+/*
+ * Call as often as possible. Returns true with the timer error in parts per
+ * billion (positive if the timer runs fast) each time a window completes.
+ * The time is read right after the frame number, so a stall elsewhere in the
+ * loop (such as a flash write) doesn't skew it
+ */
+bool timebase_update(struct timebase* t, int32_t* ppb) {
+    uint32_t frame = usb_hw->sof_rd & USB_SOF_RD_BITS;
+    uint64_t now = time_us_64();
+
+    if (frame == t->last_frame) {
+        if (now - t->last_frame_time > FRAME_TIMEOUT_US) {
+            t->running = false;
+        }
+        return false;
+    }
+
+    uint32_t delta = (frame - t->last_frame) & USB_SOF_RD_BITS;
+    t->last_frame = frame;
+    t->last_frame_time = now;
+
+    if (!t->running) {
+        t->running = true;
+        t->start_time = now;
+        t->frames = 0;
+        return false;
+    }
+
+    t->frames += delta;
+    if (t->frames < WINDOW_FRAMES) {
+        return false;
+    }
+
+    int64_t expected = (int64_t)t->frames * US_PER_FRAME;
+    int64_t error =
+        ((int64_t)(now - t->start_time) - expected) * PPB / expected;
+
+    t->start_time = now;
+    t->frames = 0;
+
+    if (llabs(error) > MAX_ERROR_PPB) {
+        return false;
+    }
+    *ppb = error;
+    return true;
+}
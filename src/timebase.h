@@ -0,0 +1,20 @@
+/*
+ * System timer error measurement against the USB start of frame clock
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2024 Joshua Watt
+ */
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct timebase;
+
+struct timebase* timebase_create(void);
+void timebase_free(struct timebase* t);
+bool timebase_update(struct timebase* t, int32_t* ppb);
+
+#endif
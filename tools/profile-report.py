@@ -0,0 +1,102 @@
+#! /usr/bin/env python3
+#
+# Summarizes a `profile dump` from the nutator console by function
+#
+# SPDX-License-Identifier: MIT
+#
+# Copyright (c) 2024 Joshua Watt
+
+import argparse
+import bisect
+import subprocess
+import sys
+
+
+def read_symbols(nm, elf):
+    symbols = []
+    out = subprocess.run(
+        [nm, "--defined-only", "-n", "-S", elf],
+        check=True,
+        capture_output=True,
+        text=True,
+    ).stdout
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) != 4 or fields[2] not in "tTwW":
+            continue
+        addr = int(fields[0], 16) & ~1
+        size = int(fields[1], 16)
+        symbols.append((addr, size, fields[3]))
+    return symbols
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Summarize a nutator profile dump by function"
+    )
+    parser.add_argument("elf", help="nutator.elf the dump was taken from")
+    parser.add_argument(
+        "dump", nargs="?", help="Captured dump (default: stdin)"
+    )
+    parser.add_argument("--nm", default="arm-none-eabi-nm", help="nm to use")
+    parser.add_argument(
+        "--limit", type=int, default=30, help="Functions to show"
+    )
+    args = parser.parse_args()
+
+    symbols = read_symbols(args.nm, args.elf)
+    starts = [s[0] for s in symbols]
+
+    f = open(args.dump) if args.dump else sys.stdin
+    period = 0
+    total = 0
+    counts = {}
+    shared = set()
+    region = None
+    shift = 0
+
+    for line in f:
+        fields = line.strip().split(",")
+        if fields[0] == "profile":
+            period = int(fields[1])
+            total = int(fields[2])
+            if int(fields[3]):
+                counts["[other]"] = int(fields[3])
+        elif fields[0] == "region":
+            region = fields[1]
+            shift = int(fields[3])
+        elif fields[0] == "end":
+            break
+        elif fields[0].startswith("0x"):
+            addr = int(fields[0], 16)
+            n = int(fields[1])
+            i = bisect.bisect_right(starts, addr) - 1
+            if region == "rom":
+                name = "[bootrom]"
+            elif i >= 0 and addr < symbols[i][0] + max(symbols[i][1], 1):
+                name = symbols[i][2]
+                # A bucket that runs past the end of the function may also
+                # hold samples from the next one; it is charged to this one
+                if addr + (1 << shift) > symbols[i][0] + symbols[i][1]:
+                    shared.add(name)
+            else:
+                name = "[%s 0x%08x]" % (region, addr)
+            counts[name] = counts.get(name, 0) + n
+
+    if not total:
+        print("No samples")
+        return 1
+
+    print(
+        "%d samples every %d us (%.1f s)"
+        % (total, period, total * period / 1000000)
+    )
+    for name, n in sorted(counts.items(), key=lambda c: -c[1])[: args.limit]:
+        mark = "*" if name in shared else ""
+        print("%6.2f%% %8d  %s%s" % (n * 100 / total, n, name, mark))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())